@@ -0,0 +1,325 @@
+/*
+   This file is part of rjkshelltools
+   Copyright (C) 2014 Richard Kettlewell
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "utils.h"
+
+/* bench-io runs a producer, a command (normally iobuffer) and a
+ * consumer, connected in a pipeline, and reports how it went.
+ *
+ * The producer writes fixed-size chunks, each starting with the time
+ * it was written, so the consumer can measure the latency added by
+ * the command.  With the file transport the input is all written
+ * before the command starts, so only throughput is reported. */
+
+static struct option const long_options[] = {
+    {"bytes", required_argument, 0, 'n'},
+    {"chunk", required_argument, 0, 'c'},
+    {"produce-rate", required_argument, 0, 'p'},
+    {"produce-burst", required_argument, 0, 'P'},
+    {"consume-rate", required_argument, 0, 'q'},
+    {"consume-burst", required_argument, 0, 'Q'},
+    {"transport", required_argument, 0, 't'},
+    {"help", no_argument, 0, 'h'},
+    {"version", no_argument, 0, 'V'},
+    {0, 0, 0, 0}};
+
+enum { PIPE, SOCKETPAIR, FILE_INPUT };
+
+static const struct lookuptable transports[] = {{"pipe", PIPE},
+                                                {"socketpair", SOCKETPAIR},
+                                                {"file", FILE_INPUT},
+                                                {0, 0}};
+
+static unsigned long long total = 16 * 1024 * 1024; /* bytes to send */
+static size_t chunk = 4096;                          /* bytes per chunk */
+static double produce_rate, consume_rate;            /* bytes/s, or 0 */
+static size_t produce_burst, consume_burst;          /* bytes per burst */
+static double started;                               /* start time */
+static int timed = 1; /* true if chunk timestamps mean anything */
+
+static void __attribute__((noreturn)) usage(FILE *fp, int exit_status) {
+  if(fputs("Usage:\n"
+           "  bench-io [options] [--] command ...\n"
+           "\n"
+           "Options:\n"
+           "  -n N, --bytes N                   Bytes to send\n"
+           "  -c N, --chunk N                   Bytes per chunk\n"
+           "  -p N, --produce-rate N            Producer bytes/second\n"
+           "  -P N, --produce-burst N           Producer bytes per burst\n"
+           "  -q N, --consume-rate N            Consumer bytes/second\n"
+           "  -Q N, --consume-burst N           Consumer bytes per burst\n"
+           "  -t T, --transport T               pipe, socketpair or file\n"
+           "  -h, --help                        Usage message\n"
+           "  -V, --version                     Version number\n",
+           fp)
+     < 0)
+    fatale("output error");
+  exit(exit_status);
+}
+
+/* sleep until time WHEN */
+static void sleep_until(double when) {
+  struct timespec ts;
+  double delay = when - monotime();
+
+  if(delay <= 0)
+    return;
+  ts.tv_sec = (time_t)delay;
+  ts.tv_nsec = (long)((delay - ts.tv_sec) * 1000000000);
+  while(nanosleep(&ts, &ts) < 0)
+    if(errno != EINTR)
+      fatale("error calling nanosleep");
+}
+
+/* write TOTAL bytes to FD in chunks, at RATE bytes/second in bursts
+ * of BURST bytes */
+static void produce(int fd, double rate, size_t burst) {
+  char *buffer = xmalloc(chunk);
+  unsigned long long sent = 0;
+  size_t inburst = 0;
+  double now, start = monotime();
+
+  memset(buffer, 'x', chunk);
+  while(sent < total) {
+    now = monotime();
+    memcpy(buffer, &now, sizeof now);
+    if(writeall(fd, buffer, chunk) < 0)
+      fatale("error writing");
+    sent += chunk;
+    if(rate && (inburst += chunk) >= burst) {
+      inburst = 0;
+      sleep_until(start + sent / rate);
+    }
+  }
+}
+
+/* compare doubles, for qsort */
+static int compare(const void *a, const void *b) {
+  const double *x = a, *y = b;
+
+  return *x < *y ? -1 : *x > *y;
+}
+
+/* read chunks from FD at RATE bytes/second in bursts of BURST bytes,
+ * and report on them */
+static void consume(int fd, double rate, size_t burst) {
+  char *buffer = xmalloc(chunk);
+  size_t got, count = 0, inburst = 0, nlatencies = total / chunk;
+  double *latencies = xmalloc(nlatencies * sizeof *latencies);
+  double sent, elapsed, start = monotime();
+  ssize_t n;
+
+  for(;;) {
+    for(got = 0; got < chunk; got += n) {
+      if((n = read(fd, buffer + got, chunk - got)) < 0) {
+        if(errno == EINTR) {
+          n = 0;
+          continue;
+        }
+        fatale("error reading");
+      }
+      if(!n)
+        break;
+    }
+    if(!got)
+      break;
+    if(got < chunk)
+      fatal("partial chunk at end of input");
+    if(count == nlatencies)
+      fatal("too much input");
+    memcpy(&sent, buffer, sizeof sent);
+    latencies[count++] = monotime() - sent;
+    if(rate && (inburst += chunk) >= burst) {
+      inburst = 0;
+      sleep_until(start + count * chunk / rate);
+    }
+  }
+  if(count != nlatencies)
+    fatal("expected %lu chunks, got %lu", (unsigned long)nlatencies,
+          (unsigned long)count);
+  elapsed = monotime() - started;
+  if(printf("bytes=%llu elapsed=%.6f throughput=%.0f", total, elapsed,
+            total / elapsed)
+     < 0)
+    fatale("error writing to stdout");
+  if(timed) {
+    qsort(latencies, count, sizeof *latencies, compare);
+    if(printf(" latency_p50=%.6f latency_p99=%.6f latency_max=%.6f",
+              latencies[count / 2], latencies[count * 99 / 100],
+              latencies[count - 1])
+       < 0)
+      fatale("error writing to stdout");
+  }
+  if(printf("\n") < 0 || fflush(stdout) < 0)
+    fatale("error writing to stdout");
+}
+
+/* make a connected pair of file descriptors of the given TYPE.
+ * fds[0] is for reading and fds[1] for writing. */
+static void connect_pair(int fds[2], int type) {
+  if(type == SOCKETPAIR) {
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+      fatale("error calling socketpair");
+  } else
+    pipe_e(fds);
+}
+
+/* fork a child with stdin IN and stdout OUT, closing everything in
+ * CLOSE (a -1-terminated list) */
+static pid_t child(int in, int out, const int *close) {
+  pid_t pid;
+
+  if(!(pid = fork_e())) {
+    exiter = _exit;
+    if(in != 0) {
+      dup2_e(in, 0);
+      close_e(in);
+    }
+    if(out != 1) {
+      dup2_e(out, 1);
+      close_e(out);
+    }
+    for(; *close != -1; ++close)
+      if(*close != in && *close != out)
+        close_e(*close);
+  }
+  return pid;
+}
+
+int main(int argc, char **argv) {
+  int n, transport = PIPE, w, failed = 0;
+  int input[2], output[2];
+  int fds[5];
+  pid_t pids[3];
+  char path[] = "/tmp/bench-io.XXXXXX";
+
+  setprogname(argv[0]);
+  while((n = getopt_long(argc, argv, "+n:c:p:P:q:Q:t:hV", long_options,
+                         (int *)0))
+        >= 0) {
+    switch(n) {
+    case 'V': printf("bench-io %s\n", VERSION); return 0;
+
+    case 'h': usage(stdout, 0);
+
+    case 'n': total = strtoull(optarg, 0, 10); break;
+
+    case 'c': chunk = atol(optarg); break;
+
+    case 'p': produce_rate = atof(optarg); break;
+
+    case 'P': produce_burst = atol(optarg); break;
+
+    case 'q': consume_rate = atof(optarg); break;
+
+    case 'Q': consume_burst = atol(optarg); break;
+
+    case 't':
+      if((transport = lookup(transports, optarg)) < 0)
+        fatal("unknown transport '%s'", optarg);
+      break;
+
+    default: usage(stderr, 1);
+    }
+  }
+  if(optind >= argc)
+    fatal("no command specified");
+  if(chunk < sizeof(double))
+    fatal("--chunk must be at least %lu", (unsigned long)sizeof(double));
+  /* whole chunks only, so the consumer knows where they start */
+  total -= total % chunk;
+  if(!total)
+    fatal("--bytes must be at least --chunk");
+  if(!produce_burst)
+    produce_burst = chunk;
+  if(!consume_burst)
+    consume_burst = chunk;
+
+  /* a SIGPIPE will show up as a failed child */
+  signal(SIGPIPE, SIG_DFL);
+  if(transport == FILE_INPUT) {
+    /* produce the input up front; its timestamps are all from before
+     * the command started, so they say nothing about latency */
+    timed = 0;
+    if((input[0] = mkstemp(path)) < 0)
+      fatale("error creating %s", path);
+    unlink(path);
+    produce(input[0], 0, 0);
+    if(lseek(input[0], 0, SEEK_SET) < 0)
+      fatale("error calling lseek");
+    input[1] = -1;
+    connect_pair(output, PIPE);
+  } else {
+    connect_pair(input, transport);
+    connect_pair(output, transport);
+  }
+  /* list of file descriptors the children must close */
+  n = 0;
+  fds[n++] = input[0];
+  if(input[1] != -1)
+    fds[n++] = input[1];
+  fds[n++] = output[0];
+  fds[n++] = output[1];
+  fds[n] = -1;
+  started = monotime();
+  n = 0;
+  if(input[1] != -1) {
+    if(!(pids[n++] = child(0, input[1], fds))) {
+      produce(1, produce_rate, produce_burst);
+      _exit(0);
+    }
+  }
+  if(!(pids[n++] = child(input[0], output[1], fds))) {
+    execvp(argv[optind], argv + optind);
+    fatale("error executing %s", argv[optind]);
+  }
+  if(!(pids[n++] = child(output[0], 1, fds))) {
+    consume(0, consume_rate, consume_burst);
+    _exit(0);
+  }
+  for(w = 0; fds[w] != -1; ++w)
+    close_e(fds[w]);
+  while(n > 0) {
+    if(waitpid_e(pids[--n], &w, 0) && w) {
+      error("pid %ld: %s", (long)pids[n], wstat(w));
+      failed = 1;
+    }
+  }
+  return failed;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+End:
+*/
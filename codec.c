@@ -0,0 +1,262 @@
+/*
+   This file is part of rjkshelltools
+   Copyright (C) 2014 Richard Kettlewell
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <config.h>
+
+#if HAVE_ZLIB && HAVE_PTHREAD
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "utils.h"
+#include "codec.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wanted = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t resumed = PTHREAD_COND_INITIALIZER;
+static struct job *todo, **todo_tail = &todo; /* jobs not yet started */
+static int notify[2];                         /* worker -> main thread */
+static int decompressing;                     /* true to decompress */
+static int level;                             /* compression level */
+static size_t outmax;                         /* most output per job */
+static z_stream inflater;                     /* decompression state */
+static int in_member;                         /* inflater is mid-stream */
+
+/* compress J into a gzip member of its own */
+static void deflate_job(struct job *j) {
+  z_stream z;
+
+  memset(&z, 0, sizeof z);
+  /* 16 + 15 means a gzip wrapper round a 32KB window */
+  if(deflateInit2(&z, level, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY)
+     != Z_OK)
+    fatal("error calling deflateInit2: %s", z.msg ? z.msg : "unknown error");
+  j->outsize = deflateBound(&z, j->inlen);
+  j->out = xmalloc(j->outsize);
+  z.next_in = (Bytef *)j->in;
+  z.avail_in = j->inlen;
+  z.next_out = (Bytef *)j->out;
+  z.avail_out = j->outsize;
+  if(deflate(&z, Z_FINISH) != Z_STREAM_END)
+    fatal("error compressing: %s", z.msg ? z.msg : "unknown error");
+  j->outlen = j->outsize - z.avail_out;
+  deflateEnd(&z);
+}
+
+/* tell the main thread that a job has finished */
+static void wake(void) {
+  int rc;
+
+  /* if the pipe is full, the main thread has a wakeup pending
+   * anyway */
+  do
+    rc = write(notify[1], "", 1);
+  while(rc < 0 && errno == EINTR);
+}
+
+/* hand J's output so far to the main thread and wait for it to be
+ * emptied */
+static void pause_job(struct job *j) {
+  pthread_mutex_lock(&lock);
+  j->paused = j->done = 1;
+  pthread_mutex_unlock(&lock);
+  wake();
+  pthread_mutex_lock(&lock);
+  while(j->paused)
+    pthread_cond_wait(&resumed, &lock);
+  pthread_mutex_unlock(&lock);
+}
+
+/* decompress J, carrying on from the previous job */
+static void inflate_job(struct job *j) {
+  int rc, stuck = 0;
+
+  inflater.next_in = (Bytef *)j->in;
+  inflater.avail_in = j->inlen;
+  /* the inflater can have read all its input and still be holding
+   * output and the end of the member.  The next job will flush that
+   * out, but the last job must do it itself. */
+  while(!stuck && (inflater.avail_in > 0 || (j->last && in_member))) {
+    if(j->outlen == j->outsize) {
+      /* a small input can expand enormously, so the output is handed
+       * over in pieces rather than growing without limit */
+      if(j->outsize >= outmax) {
+        pause_job(j);
+        continue;
+      }
+      j->outsize = j->outsize ? 2 * j->outsize : 4 * j->inlen;
+      if(j->outsize > outmax)
+        j->outsize = outmax;
+      j->out = xrealloc(j->out, j->outsize);
+    }
+    inflater.next_out = (Bytef *)j->out + j->outlen;
+    inflater.avail_out = j->outsize - j->outlen;
+    rc = inflate(&inflater, Z_NO_FLUSH);
+    j->outlen = j->outsize - inflater.avail_out;
+    switch(rc) {
+    case Z_OK: in_member = 1; break;
+    case Z_STREAM_END:
+      /* there may be another member after this one */
+      inflateReset(&inflater);
+      in_member = 0;
+      break;
+    case Z_BUF_ERROR: stuck = 1; break; /* there's room, so out of input */
+    default:
+      fatal("error decompressing: %s",
+            inflater.msg ? inflater.msg : "unknown error");
+    }
+  }
+  if(j->last && in_member)
+    fatal("compressed input is truncated");
+}
+
+/* take jobs off the queue and process them, forever */
+static void *__attribute__((noreturn)) worker(void __attribute__((unused))
+                                              * arg) {
+  struct job *j;
+
+  for(;;) {
+    pthread_mutex_lock(&lock);
+    while(!todo)
+      pthread_cond_wait(&wanted, &lock);
+    j = todo;
+    if(!(todo = j->todo))
+      todo_tail = &todo;
+    pthread_mutex_unlock(&lock);
+    if(decompressing)
+      inflate_job(j);
+    else
+      deflate_job(j);
+    pthread_mutex_lock(&lock);
+    j->done = 1;
+    pthread_mutex_unlock(&lock);
+    wake();
+  }
+}
+
+int codec_start(int decompress, int compression_level, int threads,
+                size_t max_output) {
+  pthread_t id;
+  sigset_t all, saved;
+  int n, rc;
+
+  decompressing = decompress;
+  level = compression_level;
+  outmax = max_output;
+  if(decompress) {
+    /* 32 + 15 means detect gzip or zlib format */
+    if(inflateInit2(&inflater, 32 + 15) != Z_OK)
+      fatal("error calling inflateInit2");
+    threads = 1;
+  }
+  pipe_e(notify);
+  for(n = 0; n < 2; ++n) {
+    nonblock(notify[n]);
+    cloexec(notify[n]);
+  }
+  /* signals are for the main thread */
+  sigfillset(&all);
+  if((rc = pthread_sigmask(SIG_BLOCK, &all, &saved)))
+    fatal("error calling pthread_sigmask: %s", strerror(rc));
+  for(n = 0; n < threads; ++n)
+    if((rc = pthread_create(&id, 0, worker, 0)))
+      fatal("error calling pthread_create: %s", strerror(rc));
+  if((rc = pthread_sigmask(SIG_SETMASK, &saved, 0)))
+    fatal("error calling pthread_sigmask: %s", strerror(rc));
+  return notify[0];
+}
+
+void codec_submit(struct job *j) {
+  j->todo = 0;
+  pthread_mutex_lock(&lock);
+  *todo_tail = j;
+  todo_tail = &j->todo;
+  pthread_cond_signal(&wanted);
+  pthread_mutex_unlock(&lock);
+}
+
+int codec_finished(struct job *j) {
+  int done;
+
+  pthread_mutex_lock(&lock);
+  done = j->done;
+  pthread_mutex_unlock(&lock);
+  return done;
+}
+
+int codec_resume(struct job *j) {
+  int paused;
+
+  pthread_mutex_lock(&lock);
+  if((paused = j->paused)) {
+    j->outlen = j->copied = 0;
+    j->paused = j->done = 0;
+    pthread_cond_broadcast(&resumed);
+  }
+  pthread_mutex_unlock(&lock);
+  return paused;
+}
+
+void codec_drain(void) {
+  char buffer[64];
+
+  while(read(notify[0], buffer, sizeof buffer) > 0)
+    ;
+}
+
+#else
+
+#include "utils.h"
+#include "codec.h"
+
+int __attribute__((noreturn))
+codec_start(int __attribute__((unused)) decompress,
+            int __attribute__((unused)) compression_level,
+            int __attribute__((unused)) threads,
+            size_t __attribute__((unused)) max_output) {
+  fatal("compression is not supported on this platform");
+}
+
+void codec_submit(struct job __attribute__((unused)) * j) {
+}
+
+int codec_finished(struct job __attribute__((unused)) * j) {
+  return 0;
+}
+
+int codec_resume(struct job __attribute__((unused)) * j) {
+  return 0;
+}
+
+void codec_drain(void) {
+}
+
+#endif
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+End:
+*/
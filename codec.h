@@ -0,0 +1,78 @@
+/*
+   This file is part of rjkshelltools
+   Copyright (C) 2014 Richard Kettlewell
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+
+/* Compression and decompression on worker threads.
+ *
+ * Input is divided into jobs which are handed to the workers in
+ * order; results are collected in the same order.  When compressing,
+ * each job becomes a separate gzip member, so jobs are independent
+ * and several workers can be used.  Decompression is inherently
+ * serial, so only one worker is used.
+ *
+ * Errors are fatal. */
+
+struct job {
+  struct job *next; /* for the caller's use */
+  struct job *todo; /* for the workers' use */
+  char *in;         /* input data */
+  size_t inlen;     /* bytes of input */
+  char *out;        /* output data */
+  size_t outlen;    /* bytes of output */
+  size_t outsize;   /* size of out */
+  size_t copied;    /* bytes of output consumed by the caller */
+  int last;         /* true for the final job */
+  int done;         /* set by the worker, protected by a lock */
+  int paused;       /* worker waiting for out to be emptied, ditto */
+  double started;   /* when the first input arrived */
+};
+
+/* start THREADS workers.  DECOMPRESS is true to decompress, otherwise
+ * LEVEL is the compression level.  Decompression produces at most
+ * MAX_OUTPUT bytes of output per job at a time.  Returns a file
+ * descriptor that becomes readable when a job has finished; the caller
+ * should drain it with codec_drain(). */
+int codec_start(int decompress, int level, int threads, size_t max_output);
+
+/* hand J to the workers */
+void codec_submit(struct job *j);
+
+/* return true if J has finished */
+int codec_finished(struct job *j);
+
+/* if J finished early because its output was full, discard the output
+ * (which the caller must have consumed) and hand J back to its worker
+ * to carry on; returns true if so */
+int codec_resume(struct job *j);
+
+/* drain the notification file descriptor */
+void codec_drain(void);
+
+#endif /* CODEC_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+End:
+*/
@@ -0,0 +1,428 @@
+/*
+   This file is part of rjkshelltools
+   Copyright (C) 2014 Richard Kettlewell
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#if defined __GNUC__ && defined __x86_64__
+#include <nmmintrin.h>
+#define CRC32C_SSE42 1
+#endif
+
+#include "utils.h"
+#include "digest.h"
+
+struct digest {
+  const struct algorithm *alg; /* algorithm in use */
+  union {
+    uint32_t crc; /* crc32c */
+    struct {
+      uint64_t v[4];         /* accumulators */
+      uint64_t total;        /* bytes so far */
+      unsigned char mem[32]; /* partial stripe */
+      size_t memsize;        /* bytes in mem */
+    } xxh;                   /* xxh64 */
+    struct {
+      uint32_t h[8];         /* hash state */
+      uint64_t total;        /* bytes so far */
+      unsigned char mem[64]; /* partial block */
+      size_t memsize;        /* bytes in mem */
+    } sha;                   /* sha256 */
+  } u;
+};
+
+struct algorithm {
+  const char *name;                                     /* name */
+  void (*init)(struct digest *d);                       /* set up */
+  void (*update)(struct digest *d, const unsigned char *p, size_t len);
+  size_t (*final)(struct digest *d, unsigned char *out); /* finish */
+};
+
+static uint32_t get32le(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16
+         | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get64le(const unsigned char *p) {
+  return (uint64_t)get32le(p) | (uint64_t)get32le(p + 4) << 32;
+}
+
+static uint32_t get32be(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8
+         | (uint32_t)p[3];
+}
+
+static void put32be(unsigned char *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+/* CRC-32C ------------------------------------------------------------------ */
+
+#define CRC32C_POLY 0x82F63B78 /* reversed Castagnoli polynomial */
+
+static uint32_t crc32c_table[8][256]; /* for slicing-by-8 */
+static int crc32c_hw;                 /* true to use the crc32 insn */
+
+static void crc32c_init(struct digest *d) {
+  uint32_t crc;
+  int n, k;
+
+  if(!crc32c_table[0][1]) {
+#if CRC32C_SSE42
+    __builtin_cpu_init();
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+    for(n = 0; n < 256; ++n) {
+      crc = n;
+      for(k = 0; k < 8; ++k)
+        crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+      crc32c_table[0][n] = crc;
+    }
+    for(n = 0; n < 256; ++n)
+      for(k = 1; k < 8; ++k)
+        crc32c_table[k][n] = (crc32c_table[k - 1][n] >> 8)
+                             ^ crc32c_table[0][crc32c_table[k - 1][n] & 0xFF];
+  }
+  d->u.crc = 0xFFFFFFFF;
+}
+
+#if CRC32C_SSE42
+/* CRC-32C using the SSE4.2 crc32 instruction, 8 bytes at a time */
+static uint32_t __attribute__((target("sse4.2")))
+crc32c_sse42(uint32_t crc32, const unsigned char *p, size_t len) {
+  uint64_t crc = crc32, v;
+
+  while(len >= 8) {
+    memcpy(&v, p, 8);
+    crc = _mm_crc32_u64(crc, v);
+    p += 8;
+    len -= 8;
+  }
+  crc32 = crc;
+  while(len--)
+    crc32 = _mm_crc32_u8(crc32, *p++);
+  return crc32;
+}
+#endif
+
+static void crc32c_update(struct digest *d, const unsigned char *p,
+                          size_t len) {
+  uint32_t crc = d->u.crc;
+
+#if CRC32C_SSE42
+  if(crc32c_hw) {
+    d->u.crc = crc32c_sse42(crc, p, len);
+    return;
+  }
+#endif
+  while(len >= 8) {
+    crc ^= get32le(p);
+    crc = crc32c_table[7][crc & 0xFF] ^ crc32c_table[6][(crc >> 8) & 0xFF]
+          ^ crc32c_table[5][(crc >> 16) & 0xFF] ^ crc32c_table[4][crc >> 24]
+          ^ crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]]
+          ^ crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+    p += 8;
+    len -= 8;
+  }
+  while(len--)
+    crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+  d->u.crc = crc;
+}
+
+static size_t crc32c_final(struct digest *d, unsigned char *out) {
+  put32be(out, ~d->u.crc);
+  return 4;
+}
+
+/* XXH64 -------------------------------------------------------------------- */
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+  return x << r | x >> (64 - r);
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * XXH_P2;
+  acc = rotl64(acc, 31);
+  return acc * XXH_P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+  acc ^= xxh_round(0, v);
+  return acc * XXH_P1 + XXH_P4;
+}
+
+static void xxh64_init(struct digest *d) {
+  d->u.xxh.v[0] = XXH_P1 + XXH_P2;
+  d->u.xxh.v[1] = XXH_P2;
+  d->u.xxh.v[2] = 0;
+  d->u.xxh.v[3] = -XXH_P1;
+  d->u.xxh.total = 0;
+  d->u.xxh.memsize = 0;
+}
+
+/* consume one 32-byte stripe */
+static void xxh64_stripe(uint64_t *v, const unsigned char *p) {
+  v[0] = xxh_round(v[0], get64le(p));
+  v[1] = xxh_round(v[1], get64le(p + 8));
+  v[2] = xxh_round(v[2], get64le(p + 16));
+  v[3] = xxh_round(v[3], get64le(p + 24));
+}
+
+static void xxh64_update(struct digest *d, const unsigned char *p,
+                         size_t len) {
+  size_t n;
+
+  d->u.xxh.total += len;
+  if(d->u.xxh.memsize) {
+    n = 32 - d->u.xxh.memsize;
+    if(n > len)
+      n = len;
+    memcpy(d->u.xxh.mem + d->u.xxh.memsize, p, n);
+    d->u.xxh.memsize += n;
+    p += n;
+    len -= n;
+    if(d->u.xxh.memsize < 32)
+      return;
+    xxh64_stripe(d->u.xxh.v, d->u.xxh.mem);
+    d->u.xxh.memsize = 0;
+  }
+  while(len >= 32) {
+    xxh64_stripe(d->u.xxh.v, p);
+    p += 32;
+    len -= 32;
+  }
+  memcpy(d->u.xxh.mem, p, len);
+  d->u.xxh.memsize = len;
+}
+
+static size_t xxh64_final(struct digest *d, unsigned char *out) {
+  const uint64_t *v = d->u.xxh.v;
+  const unsigned char *p = d->u.xxh.mem;
+  size_t len = d->u.xxh.memsize;
+  uint64_t h;
+
+  if(d->u.xxh.total >= 32) {
+    h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12)
+        + rotl64(v[3], 18);
+    h = xxh_merge(h, v[0]);
+    h = xxh_merge(h, v[1]);
+    h = xxh_merge(h, v[2]);
+    h = xxh_merge(h, v[3]);
+  } else
+    h = XXH_P5;
+  h += d->u.xxh.total;
+  for(; len >= 8; p += 8, len -= 8) {
+    h ^= xxh_round(0, get64le(p));
+    h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+  }
+  if(len >= 4) {
+    h ^= get32le(p) * XXH_P1;
+    h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+    p += 4;
+    len -= 4;
+  }
+  for(; len > 0; ++p, --len) {
+    h ^= *p * XXH_P5;
+    h = rotl64(h, 11) * XXH_P1;
+  }
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+  put32be(out, h >> 32);
+  put32be(out + 4, h);
+  return 8;
+}
+
+/* SHA-256 ------------------------------------------------------------------ */
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROTR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void sha256_init(struct digest *d) {
+  static const uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                0x1f83d9ab, 0x5be0cd19};
+
+  memcpy(d->u.sha.h, h, sizeof h);
+  d->u.sha.total = 0;
+  d->u.sha.memsize = 0;
+}
+
+/* consume one 64-byte block */
+static void sha256_block(uint32_t *h, const unsigned char *p) {
+  uint32_t w[64], a, b, c, e, f, g, dd, hh, t1, t2;
+  int n;
+
+  for(n = 0; n < 16; ++n)
+    w[n] = get32be(p + 4 * n);
+  for(; n < 64; ++n)
+    w[n] = w[n - 16]
+           + (ROTR(w[n - 15], 7) ^ ROTR(w[n - 15], 18) ^ (w[n - 15] >> 3))
+           + w[n - 7]
+           + (ROTR(w[n - 2], 17) ^ ROTR(w[n - 2], 19) ^ (w[n - 2] >> 10));
+  a = h[0];
+  b = h[1];
+  c = h[2];
+  dd = h[3];
+  e = h[4];
+  f = h[5];
+  g = h[6];
+  hh = h[7];
+  for(n = 0; n < 64; ++n) {
+    t1 = hh + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g))
+         + sha256_k[n] + w[n];
+    t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22))
+         + ((a & b) ^ (a & c) ^ (b & c));
+    hh = g;
+    g = f;
+    f = e;
+    e = dd + t1;
+    dd = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += dd;
+  h[4] += e;
+  h[5] += f;
+  h[6] += g;
+  h[7] += hh;
+}
+
+static void sha256_update(struct digest *d, const unsigned char *p,
+                          size_t len) {
+  size_t n;
+
+  d->u.sha.total += len;
+  if(d->u.sha.memsize) {
+    n = 64 - d->u.sha.memsize;
+    if(n > len)
+      n = len;
+    memcpy(d->u.sha.mem + d->u.sha.memsize, p, n);
+    d->u.sha.memsize += n;
+    p += n;
+    len -= n;
+    if(d->u.sha.memsize < 64)
+      return;
+    sha256_block(d->u.sha.h, d->u.sha.mem);
+    d->u.sha.memsize = 0;
+  }
+  while(len >= 64) {
+    sha256_block(d->u.sha.h, p);
+    p += 64;
+    len -= 64;
+  }
+  memcpy(d->u.sha.mem, p, len);
+  d->u.sha.memsize = len;
+}
+
+static size_t sha256_final(struct digest *d, unsigned char *out) {
+  uint64_t bits = d->u.sha.total * 8;
+  unsigned char pad[72];
+  size_t padlen;
+  int n;
+
+  /* a 1 bit, zeros up to 56 mod 64, then the length in bits */
+  padlen = (d->u.sha.memsize < 56 ? 56 : 120) - d->u.sha.memsize;
+  memset(pad, 0, sizeof pad);
+  pad[0] = 0x80;
+  put32be(pad + padlen, bits >> 32);
+  put32be(pad + padlen + 4, bits);
+  sha256_update(d, pad, padlen + 8);
+  for(n = 0; n < 8; ++n)
+    put32be(out + 4 * n, d->u.sha.h[n]);
+  return 32;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static const struct algorithm algorithms[] = {
+    {"crc32c", crc32c_init, crc32c_update, crc32c_final},
+    {"xxh64", xxh64_init, xxh64_update, xxh64_final},
+    {"sha256", sha256_init, sha256_update, sha256_final},
+};
+
+#define NALGORITHMS (sizeof algorithms / sizeof *algorithms)
+
+struct digest *digest_new(const char *alg) {
+  struct digest *d;
+  size_t n;
+
+  for(n = 0; n < NALGORITHMS && strcmp(algorithms[n].name, alg); ++n)
+    ;
+  if(n == NALGORITHMS)
+    return 0;
+  d = xmalloc(sizeof *d);
+  d->alg = &algorithms[n];
+  d->alg->init(d);
+  return d;
+}
+
+void digest_update(struct digest *d, const void *data, size_t len) {
+  d->alg->update(d, data, len);
+}
+
+char *digest_final(struct digest *d) {
+  unsigned char out[32];
+  char *hex;
+  size_t n, len;
+
+  len = d->alg->final(d, out);
+  hex = xmalloc(2 * len + 1);
+  for(n = 0; n < len; ++n)
+    sprintf(hex + 2 * n, "%02x", out[n]);
+  free(d);
+  return hex;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+End:
+*/
@@ -0,0 +1,55 @@
+/*
+   This file is part of rjkshelltools
+   Copyright (C) 2014 Richard Kettlewell
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stddef.h>
+
+/* Message digests, computed incrementally.
+ *
+ * The supported algorithms are:
+ *   crc32c  CRC-32C (Castagnoli), using SSE4.2 where available
+ *   xxh64   XXH64 with a seed of 0
+ *   sha256  SHA-256
+ *
+ * Results are reported as lower-case hex, in the same form as the
+ * usual command-line tools (e.g. sha256sum). */
+
+struct digest;
+
+/* return a new digest using algorithm ALG, or a null pointer if ALG
+ * isn't recognized */
+struct digest *digest_new(const char *alg);
+
+/* add LEN bytes at DATA to D */
+void digest_update(struct digest *d, const void *data, size_t len);
+
+/* finish D, return the result as a hex string allocated with
+ * xmalloc, and free D */
+char *digest_final(struct digest *d);
+
+#endif /* DIGEST_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+End:
+*/
@@ -0,0 +1,297 @@
+/*
+   This file is part of rjkshelltools
+   Copyright (C) 2014 Richard Kettlewell
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include "utils.h"
+#include "evloop.h"
+
+#define MAXEVENTS 64 /* events to collect per epoll_wait */
+
+struct evhandler {
+  ev_callback *callback; /* callback, or 0 if FD not in use */
+  void *u;               /* callback data */
+  unsigned events;       /* events of interest */
+  unsigned registered;   /* events the kernel knows about */
+  int inkernel;          /* true if FD is registered with the kernel */
+  int always;            /* true if FD is always ready */
+};
+
+struct evloop {
+  struct evhandler *handlers; /* handlers indexed by FD */
+  int nhandlers;              /* size of handlers array */
+  int *always;                /* FDs that are always ready */
+  int nalways;                /* number of always-ready FDs */
+  unsigned long waits;        /* number of waits */
+#if HAVE_SYS_EPOLL_H
+  int epfd; /* epoll instance */
+#else
+  struct pollfd *pfds; /* argument to poll(2) */
+#endif
+};
+
+struct evloop *ev_new(void) {
+  struct evloop *ev = xmalloc(sizeof *ev);
+
+  memset(ev, 0, sizeof *ev);
+#if HAVE_SYS_EPOLL_H
+  if((ev->epfd = epoll_create(MAXEVENTS)) < 0)
+    fatale("error calling epoll_create");
+  cloexec(ev->epfd);
+#endif
+  return ev;
+}
+
+void ev_delete(struct evloop *ev) {
+#if HAVE_SYS_EPOLL_H
+  close(ev->epfd);
+#else
+  free(ev->pfds);
+#endif
+  free(ev->handlers);
+  free(ev->always);
+  free(ev);
+}
+
+/* return the handler for FD, which must exist */
+static struct evhandler *find(struct evloop *ev, int fd) {
+  if(fd < 0 || fd >= ev->nhandlers || !ev->handlers[fd].callback)
+    fatal("file descriptor %d is not in the event loop", fd);
+  return &ev->handlers[fd];
+}
+
+#if HAVE_SYS_EPOLL_H
+/* tell the kernel about a change to the events for FD.  OP is one of
+ * EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL. */
+static void control(struct evloop *ev, int fd, int op) {
+  struct evhandler *h = &ev->handlers[fd];
+  struct epoll_event e;
+
+  memset(&e, 0, sizeof e);
+  if(h->events & EV_READ)
+    e.events |= EPOLLIN;
+  if(h->events & EV_WRITE)
+    e.events |= EPOLLOUT;
+  if(h->events & EV_EDGE)
+    e.events |= EPOLLET;
+  e.data.fd = fd;
+  if(epoll_ctl(ev->epfd, op, fd, &e) < 0) {
+    /* epoll won't watch regular files, but they never block anyway */
+    if(op == EPOLL_CTL_ADD && errno == EPERM) {
+      h->always = 1;
+      ev->always = xrealloc(ev->always, (ev->nalways + 1) * sizeof(int));
+      ev->always[ev->nalways++] = fd;
+      return;
+    }
+    fatale("error calling epoll_ctl");
+  }
+  h->inkernel = op != EPOLL_CTL_DEL;
+  h->registered = h->events;
+}
+
+/* bring the kernel's idea of FD's events up to date */
+static void update(struct evloop *ev, int fd) {
+  struct evhandler *h = &ev->handlers[fd];
+
+  if(h->always)
+    return;
+  if(!h->inkernel) {
+    if(h->events & (EV_READ | EV_WRITE))
+      control(ev, fd, EPOLL_CTL_ADD);
+    return;
+  }
+  if(h->events == h->registered)
+    return;
+  /* edge-triggered FDs can keep extra events enabled; the cost is an
+   * occasional spurious callback, rather than a system call every
+   * time the caller's interest changes */
+  if((h->events & h->registered & EV_EDGE) && !(h->events & ~h->registered))
+    return;
+  /* if nothing is wanted, remove the FD completely, otherwise hangups
+   * would still be reported (over and over, if level-triggered) */
+  if(!(h->events & (EV_READ | EV_WRITE)))
+    control(ev, fd, EPOLL_CTL_DEL);
+  else
+    control(ev, fd, EPOLL_CTL_MOD);
+}
+#endif
+
+void ev_add(struct evloop *ev, int fd, unsigned events, ev_callback *callback,
+            void *u) {
+  struct evhandler *h;
+
+  if(fd < 0)
+    fatal("cannot watch file descriptor %d", fd);
+  if(fd >= ev->nhandlers) {
+    int n = ev->nhandlers ? ev->nhandlers : 16;
+
+    while(n <= fd)
+      n *= 2;
+    ev->handlers = xrealloc(ev->handlers, n * sizeof *ev->handlers);
+    memset(ev->handlers + ev->nhandlers, 0,
+           (n - ev->nhandlers) * sizeof *ev->handlers);
+    ev->nhandlers = n;
+  }
+  h = &ev->handlers[fd];
+  if(h->callback)
+    fatal("file descriptor %d is already in the event loop", fd);
+  memset(h, 0, sizeof *h);
+  h->callback = callback;
+  h->u = u;
+  h->events = events;
+#if HAVE_SYS_EPOLL_H
+  update(ev, fd);
+#endif
+}
+
+void ev_modify(struct evloop *ev, int fd, unsigned events) {
+  struct evhandler *h = find(ev, fd);
+
+  if(h->events == events)
+    return;
+  h->events = events;
+#if HAVE_SYS_EPOLL_H
+  update(ev, fd);
+#endif
+}
+
+void ev_remove(struct evloop *ev, int fd) {
+  struct evhandler *h = find(ev, fd);
+  int n;
+
+#if HAVE_SYS_EPOLL_H
+  if(h->inkernel)
+    control(ev, fd, EPOLL_CTL_DEL);
+#endif
+  if(h->always) {
+    for(n = 0; ev->always[n] != fd; ++n)
+      ;
+    ev->always[n] = ev->always[--ev->nalways];
+  }
+  memset(h, 0, sizeof *h);
+}
+
+/* call back for FD, if it still wants to know about EVENTS */
+static int dispatch(struct evloop *ev, int fd, unsigned events) {
+  struct evhandler *h;
+
+  if(fd >= ev->nhandlers || !(h = &ev->handlers[fd])->callback)
+    return 0; /* removed by an earlier callback */
+  if(!(h->events & EV_EDGE))
+    events &= h->events;
+  if(!events)
+    return 0;
+  (*h->callback)(ev, fd, events, h->u);
+  return 1;
+}
+
+int ev_wait(struct evloop *ev, int timeout, const sigset_t *sigmask) {
+  int n, m, called = 0;
+
+  /* don't block if something is permanently ready */
+  for(n = 0; n < ev->nalways; ++n)
+    if(ev->handlers[ev->always[n]].events & (EV_READ | EV_WRITE))
+      timeout = 0;
+  ++ev->waits;
+#if HAVE_SYS_EPOLL_H
+  {
+    struct epoll_event events[MAXEVENTS];
+
+    if((m = epoll_pwait(ev->epfd, events, MAXEVENTS, timeout, sigmask)) < 0)
+      return -1;
+    for(n = 0; n < m; ++n) {
+      unsigned e = 0;
+
+      if(events[n].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        e |= EV_READ;
+      if(events[n].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+        e |= EV_WRITE;
+      called += dispatch(ev, events[n].data.fd, e);
+    }
+  }
+#else
+  {
+    int fd, npfds = 0;
+    sigset_t saved;
+
+    ev->pfds = xrealloc(ev->pfds, ev->nhandlers * sizeof *ev->pfds);
+    for(fd = 0; fd < ev->nhandlers; ++fd) {
+      const struct evhandler *h = &ev->handlers[fd];
+
+      if(h->callback && (h->events & (EV_READ | EV_WRITE))) {
+        ev->pfds[npfds].fd = fd;
+        ev->pfds[npfds].events = ((h->events & EV_READ ? POLLIN : 0)
+                                  | (h->events & EV_WRITE ? POLLOUT : 0));
+        ev->pfds[npfds].revents = 0;
+        ++npfds;
+      }
+    }
+    if(sigmask)
+      sigprocmask_e(SIG_SETMASK, sigmask, &saved);
+    m = poll(ev->pfds, npfds, timeout);
+    if(sigmask) {
+      int save_errno = errno;
+
+      sigprocmask_e(SIG_SETMASK, &saved, 0);
+      errno = save_errno;
+    }
+    if(m < 0)
+      return -1;
+    for(n = 0; n < npfds && m > 0; ++n) {
+      unsigned e = 0;
+      short r = ev->pfds[n].revents;
+
+      if(!r)
+        continue;
+      --m;
+      if(r & (POLLIN | POLLERR | POLLHUP | POLLNVAL))
+        e |= EV_READ;
+      if(r & (POLLOUT | POLLERR | POLLHUP | POLLNVAL))
+        e |= EV_WRITE;
+      called += dispatch(ev, ev->pfds[n].fd, e);
+    }
+  }
+#endif
+  /* callbacks may add or remove always-ready FDs, so be careful */
+  for(n = 0; n < ev->nalways; ++n)
+    called += dispatch(ev, ev->always[n], EV_READ | EV_WRITE);
+  return called;
+}
+
+unsigned long ev_waits(const struct evloop *ev) {
+  return ev->waits;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+End:
+*/
@@ -0,0 +1,92 @@
+/*
+   This file is part of rjkshelltools
+   Copyright (C) 2014 Richard Kettlewell
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <signal.h>
+
+/* An event loop watches a collection of file descriptors and calls a
+ * callback for each one that becomes readable or writable.  Handlers
+ * are indexed by file descriptor, so the cost of a wakeup depends on
+ * the number of ready file descriptors, not the number being watched.
+ *
+ * epoll(7) is used where available, otherwise poll(2).
+ *
+ * File descriptors that can't be waited for (for instance regular
+ * files, which epoll refuses) are treated as permanently ready.
+ *
+ * All these functions call fatal/fatale on error, unless otherwise
+ * specified. */
+
+#define EV_READ 1  /* interested in readability */
+#define EV_WRITE 2 /* interested in writability */
+#define EV_EDGE 4  /* only report changes in readiness */
+
+struct evloop;
+
+/* callback for a ready file descriptor.  EVENTS is a combination of
+ * EV_READ and EV_WRITE.  Errors and hangups are reported as both, so
+ * that the callback will attempt I/O and find out what happened. */
+typedef void ev_callback(struct evloop *ev, int fd, unsigned events, void *u);
+
+/* create a new event loop */
+struct evloop *ev_new(void);
+
+/* destroy event loop EV.  Watched file descriptors are not closed. */
+void ev_delete(struct evloop *ev);
+
+/* start watching FD for EVENTS.  When it's ready CALLBACK will be
+ * called with U as its last argument.
+ *
+ * If EV_EDGE is included then the callback is only guaranteed to be
+ * called when FD goes from not ready to ready, so the caller should
+ * keep doing I/O until it gets EAGAIN before relying on another
+ * callback.  EV_EDGE handlers may also be told about events they have
+ * lost interest in, since it is cheaper to leave them enabled. */
+void ev_add(struct evloop *ev, int fd, unsigned events, ev_callback *callback,
+            void *u);
+
+/* change the events FD is being watched for.  This has no cost if
+ * EVENTS hasn't changed. */
+void ev_modify(struct evloop *ev, int fd, unsigned events);
+
+/* stop watching FD.  This must be called before FD is closed. */
+void ev_remove(struct evloop *ev, int fd);
+
+/* wait for at most TIMEOUT milliseconds (or indefinitely if TIMEOUT
+ * is negative) and call the callbacks for any file descriptors that
+ * are ready.  If SIGMASK is not a null pointer then it is the signal
+ * mask in force while waiting.
+ *
+ * Returns the number of callbacks made, or -1 on error with errno
+ * set (including EINTR if a signal was delivered). */
+int ev_wait(struct evloop *ev, int timeout, const sigset_t *sigmask);
+
+/* return the number of times ev_wait() has waited */
+unsigned long ev_waits(const struct evloop *ev);
+
+#endif /* EVLOOP_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+End:
+*/
@@ -30,10 +30,21 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
 
 #include "uio.h"
 #include "utils.h"
+#include "evloop.h"
+#include "ring.h"
+#include "codec.h"
+#include "digest.h"
 
+static struct ring ring;   /* memory for the buffer */
+static unsigned ring_flags = RING_MIRROR; /* how to allocate it */
 static char *buffer;       /* base of buffer */
 static size_t offset;      /* offset of start of text */
 static size_t total_bytes; /* total bytes in buffer */
@@ -44,7 +55,123 @@ static size_t buffer_size = 1048576; /* maximum data to hold in memory */
 
 static int seen_eof; /* true if we've seen read eof */
 
-static int stdinflags, stdoutflags; /* saved F_GETFL flags */
+static int stdinflags; /* saved F_GETFL flags */
+
+/* an output.  Each output has its own position in the buffer; data is
+ * only discarded once every output has written it. */
+struct output {
+  int fd;                     /* file descriptor, or -1 if disconnected */
+  int flags;                  /* saved F_GETFL flags */
+  int writable;               /* might not block */
+  size_t pending;             /* bytes not yet written to this output */
+  unsigned long long written; /* bytes written */
+  unsigned long long dropped; /* bytes dropped */
+  double tokens;              /* bytes that may be written, if rate-limited */
+  double refilled;            /* when tokens was last topped up */
+  size_t atomic;              /* largest atomic write, or 0 */
+  int hungup;                 /* reader has gone, to be disconnected */
+};
+
+static struct output *outputs; /* all outputs; stdout is first */
+static int noutputs;           /* number of outputs */
+static int live_outputs;       /* number of outputs still connected */
+
+/* what to do with an output that falls too far behind */
+enum { LAG_BLOCK, LAG_DROP, LAG_DISCONNECT };
+
+static const struct lookuptable lag_policies[] = {
+    {"block", LAG_BLOCK},
+    {"drop", LAG_DROP},
+    {"disconnect", LAG_DISCONNECT},
+    {0, 0}};
+
+static size_t lag_max;              /* maximum bytes behind, or 0 */
+static int lag_policy = LAG_BLOCK; /* what to do beyond lag_max */
+
+static double rate;  /* maximum bytes/second per output, or 0 */
+static double burst; /* size of each output's token bucket */
+
+static double max_delay; /* maximum seconds to hold data, or 0 */
+
+static int line_mode;      /* true to only write whole lines */
+static size_t record_size; /* size of fixed-size records, or 0 */
+static size_t max_record;  /* longest record to keep whole, or 0 */
+static size_t record_tail; /* bytes read since the last newline */
+
+/* a note of when the input reached some point.  Marks are only made
+ * every max_delay/MARK_SPLIT seconds, so an output may be flushed up
+ * to that much sooner than it needs to be. */
+struct mark {
+  unsigned long long position; /* value of bytes_in */
+  double when;                 /* when that byte was read */
+};
+
+#define MARK_SPLIT 8
+
+static struct mark *marks;           /* marks, oldest first */
+static size_t first_mark, last_mark; /* live marks are [first,last) */
+static size_t marks_size;            /* size of marks array */
+
+static int adaptive;                   /* true to tune readmin/writemin */
+static size_t adapt_min, adapt_max;    /* bounds for tuning */
+static double epoch_start;             /* when this measurement began */
+static unsigned long long epoch_bytes; /* bytes moved by reads and writes */
+static unsigned long epoch_calls;      /* number of them */
+static double last_score;              /* bytes per second last time */
+static int direction = 1;              /* 1 to grow, -1 to shrink */
+
+#define EPOCH_CALLS 32 /* minimum calls per measurement */
+#define EPOCH_TIME 0.1 /* minimum seconds per measurement */
+
+static int zero_copy;                   /* true to use splice(2) */
+static int internal_pipe[2] = {-1, -1}; /* buffer in zero-copy mode */
+static int pipe_full;                   /* internal pipe refused data */
+
+static int readable; /* stdin might not block */
+
+static unsigned long reads, writes; /* read and write calls made */
+static unsigned long long bytes_in;  /* bytes read */
+
+#define BUCKETS 11 /* occupancy buckets; the last is a full buffer */
+
+static int stats_fd = -1;                  /* where to report, or -1 */
+static volatile sig_atomic_t stats_wanted; /* set by SIGUSR1 */
+static double started, accounted;          /* start and last accounting */
+static double time_empty, time_full;       /* time with ring empty/full */
+static double occupancy[BUCKETS];          /* time at each occupancy */
+
+/* a spill file.  Data is appended at END and written out from
+ * START. */
+struct segment {
+  struct segment *next; /* next (newer) segment */
+  int fd;               /* file descriptor */
+  char *base;           /* where it's mapped */
+  size_t start;         /* offset of first unwritten byte */
+  size_t end;           /* offset of end of data */
+};
+
+static const char *spill_dir;                   /* where to spill, or 0 */
+static size_t spill_segment = 67108864;         /* size of a spill file */
+static struct segment *spill_head, *spill_tail; /* oldest/newest spill */
+static struct segment *spill_spare;             /* empty spill, or 0 */
+static size_t spill_bytes;                      /* total bytes spilled */
+
+/* what to do to the data on its way through */
+enum { CODEC_NONE, CODEC_COMPRESS, CODEC_DECOMPRESS };
+
+static int codec;                      /* CODEC_... */
+static int level = -1;                 /* compression level, or -1 */
+static long threads;                   /* worker threads, or 0 */
+static size_t block_size = 1048576;    /* input bytes per job */
+static struct job *reading;            /* job being read into, or 0 */
+static struct job *jobs, **jobs_tail = &jobs; /* submitted jobs, oldest first */
+static int njobs;                      /* number of submitted jobs */
+static int max_jobs;                   /* most jobs to submit at once */
+static int input_eof;                  /* true if stdin has reached EOF */
+static unsigned long long raw_bytes;   /* bytes read from stdin */
+
+static struct digest *digest; /* digest of standard output, or 0 */
+static int digest_fd = 2;     /* where to report the digest */
 
 /* Option flags and variables */
 static struct option const long_options[] = {
@@ -53,6 +180,31 @@ static struct option const long_options[] = {
     {"read-min", required_argument, 0, 'r'},
     {"write-min", required_argument, 0, 'w'},
     {"buffer", required_argument, 0, 'b'},
+    {"zero-copy", no_argument, 0, 'z'},
+    {"spill", required_argument, 0, 's'},
+    {"spill-segment", required_argument, 0, 'S'},
+    {"tee", required_argument, 0, 't'},
+    {"lag-max", required_argument, 0, 'l'},
+    {"lag-policy", required_argument, 0, 'P'},
+    {"rate", required_argument, 0, 'R'},
+    {"burst", required_argument, 0, 'B'},
+    {"stats-fd", required_argument, 0, 'F'},
+    {"line", no_argument, 0, 'n'},
+    {"record-size", required_argument, 0, 'c'},
+    {"max-record", required_argument, 0, 'x'},
+    {"adaptive", required_argument, 0, 'A'},
+    {"max-delay", required_argument, 0, 'm'},
+    {"huge-pages", no_argument, 0, 'H'},
+    {"prefault", no_argument, 0, 'p'},
+    {"lock", no_argument, 0, 'L'},
+    {"compress", no_argument, 0, 'Z'},
+    {"decompress", no_argument, 0, 'u'},
+    {"level", required_argument, 0, 'e'},
+    {"threads", required_argument, 0, 'j'},
+    {"block", required_argument, 0, 'k'},
+    {"digest", required_argument, 0, 'g'},
+    {"digest-fd", required_argument, 0, 'G'},
+    {"debug", no_argument, 0, 'd'},
     {0, 0, 0, 0}};
 
 /* write a usage message to FP and exit with the specified status */
@@ -66,6 +218,32 @@ static void __attribute__((noreturn)) usage(FILE *fp, int exit_status) {
          "  -r N, --read-min N                Read at least N bytes per call\n"
          "  -w N, --write-min N               Write at least N bytes per call\n"
          "  -b N, --buffer N                  Specify buffer size\n"
+         "  -z, --zero-copy                   Use splice(2) where possible\n"
+         "  -s DIR, --spill DIR               Overflow to files in DIR\n"
+         "  -S N, --spill-segment N           Size of each spill file\n"
+         "  -t FD[,FD...], --tee FD[,FD...]   Also write to FDs\n"
+         "  -l N, --lag-max N                 Limit how far outputs lag\n"
+         "  -P POLICY, --lag-policy POLICY    block, drop or disconnect\n"
+         "  -R N, --rate N                    Write at most N bytes/second\n"
+         "  -B N, --burst N                   Maximum burst with --rate\n"
+         "  -F FD, --stats-fd FD              Report statistics to FD\n"
+         "  -n, --line                        Only write whole lines\n"
+         "  -c N, --record-size N             Only write whole N-byte records\n"
+         "  -x N, --max-record N              Split records longer than N\n"
+         "  -A MIN,MAX, --adaptive MIN,MAX    Tune read/write sizes\n"
+         "  -m MS, --max-delay MS             Write data at most MS old\n"
+         "  -H, --huge-pages                  Use huge pages for the buffer\n"
+         "  -p, --prefault                    Fault in the buffer up front\n"
+         "  -L, --lock                        Lock the buffer into memory\n"
+         "  -Z, --compress                    Compress with gzip\n"
+         "  -u, --decompress                  Decompress gzip data\n"
+         "  -e N, --level N                   Compression level\n"
+         "  -j N, --threads N                 Compression threads\n"
+         "  -k N, --block N                   Bytes to compress per thread\n"
+         "  -g ALG, --digest ALG              crc32c, xxh64 or sha256 of "
+         "output\n"
+         "  -G FD, --digest-fd FD             Report digest to FD\n"
+         "  -d, --debug                       Debug mode\n"
          "  -h, --help                        Usage message\n"
          "  -V, --version                     Version number\n",
          fp)
@@ -76,9 +254,13 @@ static void __attribute__((noreturn)) usage(FILE *fp, int exit_status) {
 
 /* fix up stdin/stdout flags */
 static void restore_flags(void) {
+  int n;
+
   exiter = _exit; /* don't recursively call exit() */
   fcntl_e(0, F_SETFL, stdinflags);
-  fcntl_e(1, F_SETFL, stdoutflags);
+  for(n = 0; n < noutputs; ++n)
+    if(outputs[n].fd != -1)
+      fcntl_e(outputs[n].fd, F_SETFL, outputs[n].flags);
 }
 
 /* fix up stdin/stdout flags */
@@ -109,22 +291,563 @@ static void fix_fatal_signal(int n) {
   }
 }
 
+/* try to switch to zero-copy mode.  The internal pipe becomes the
+ * buffer; if the kernel won't give us a pipe big enough for the
+ * configured minimum read and write sizes we stay with the ring. */
+static void start_zero_copy(void) {
+#if HAVE_SPLICE && defined F_SETPIPE_SZ
+  int size;
+
+  pipe_e(internal_pipe);
+  if(buffer_size > INT_MAX
+     || (size = fcntl(internal_pipe[1], F_SETPIPE_SZ, (int)buffer_size)) < 0)
+    size = fcntl_e(internal_pipe[1], F_GETPIPE_SZ, 0);
+  if((size_t)size < readmin || (size_t)size < writemin) {
+    close_e(internal_pipe[0]);
+    close_e(internal_pipe[1]);
+    internal_pipe[0] = internal_pipe[1] = -1;
+    return;
+  }
+  /* the kernel rounds the size up to a whole number of pages */
+  buffer_size = size;
+  zero_copy = 1;
+#endif
+}
+
+/* allocate the buffer */
+static void alloc_buffer(void) {
+  ring_alloc(&ring, buffer_size, ring_flags);
+  buffer = ring.base;
+  if(ring.size != buffer_size)
+    debug("buffer rounded up from %zu bytes", buffer_size);
+  buffer_size = ring.size;
+  debug("%zu byte buffer%s%s%s%s", buffer_size,
+        ring.flags & RING_MIRROR ? ", mirrored" : "",
+        ring.flags & RING_HUGE ? ", huge pages" : "",
+        ring.flags & RING_PREFAULT ? ", prefaulted" : "",
+        ring.flags & RING_LOCK ? ", locked" : "");
+}
+
+/* leave zero-copy mode, moving anything still in the internal pipe
+ * into the ring */
+static void stop_zero_copy(void) {
+  size_t got = 0;
+  ssize_t n;
+
+  alloc_buffer();
+  offset = 0;
+  while(got < total_bytes) {
+    n = read(internal_pipe[0], buffer + got, total_bytes - got);
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      fatale("error reading internal pipe");
+    }
+    if(n == 0)
+      fatal("internal pipe unexpectedly empty");
+    got += n;
+  }
+  close_e(internal_pipe[0]);
+  close_e(internal_pipe[1]);
+  internal_pipe[0] = internal_pipe[1] = -1;
+  zero_copy = 0;
+  pipe_full = 0;
+}
+
+/* return true if there's room to read into the ring */
+static int ring_has_room(void) {
+  /* once we've started spilling, new data must go after the spilled
+   * data */
+  return !spill_head && buffer_size - total_bytes >= readmin;
+}
+
+/* return the number of bytes waiting to be written.  This is the
+ * same as the pending byte count of whichever output is furthest
+ * behind. */
+static size_t queued(void) {
+  return total_bytes + spill_bytes;
+}
+
 /* return true if we want to read */
 static int want_to_read(void) {
-  /* we want to read if there's at least readmin bytes available and
-   * we've not seen eof */
-  return !seen_eof && buffer_size - total_bytes >= readmin;
+  /* the workers have enough to be getting on with, or the output is
+   * too far behind to give them any more */
+  if(codec)
+    return !input_eof && njobs < max_jobs
+           && !(lag_policy == LAG_BLOCK && lag_max && queued() >= lag_max);
+  /* we want to read if there's at least readmin bytes available (or
+   * we can spill) and we've not seen eof */
+  if(seen_eof || pipe_full || !(ring_has_room() || spill_dir))
+    return 0;
+  /* we might have to wait for a slow output to catch up */
+  if(lag_policy == LAG_BLOCK && lag_max && queued() >= lag_max)
+    return 0;
+  return 1;
+}
+
+/* add an output */
+static void add_output(int fd) {
+  struct output *o;
+  int n;
+
+  if(fd == 0)
+    fatal("cannot write to standard input");
+  for(n = 0; n < noutputs; ++n)
+    if(outputs[n].fd == fd)
+      fatal("file descriptor %d specified more than once", fd);
+  outputs = xrealloc(outputs, (noutputs + 1) * sizeof *outputs);
+  o = &outputs[noutputs++];
+  memset(o, 0, sizeof *o);
+  o->fd = fd;
+  o->flags = fcntl_e(fd, F_GETFL, 0);
+  ++live_outputs;
+}
+
+/* note that BYTES new bytes have been read */
+static void added(size_t bytes) {
+  double now;
+  int n;
+
+  if(max_delay) {
+    /* note when this data arrived, unless the last mark is recent
+     * enough to do for it */
+    now = monotime();
+    /* once a mark is overdue its exact time no longer matters, since
+     * the first mark stands in for everything before it.  Dropping
+     * them keeps the array to about MARK_SPLIT entries however long an
+     * output stalls. */
+    while(first_mark + 1 < last_mark
+          && now - marks[first_mark + 1].when >= max_delay)
+      ++first_mark;
+    if(first_mark == last_mark
+       || now - marks[last_mark - 1].when >= max_delay / MARK_SPLIT) {
+      if(last_mark == marks_size) {
+        /* shuffle down if there's room, otherwise grow */
+        if(first_mark > marks_size / 2) {
+          memmove(marks, marks + first_mark,
+                  (last_mark - first_mark) * sizeof *marks);
+          last_mark -= first_mark;
+          first_mark = 0;
+        } else {
+          marks_size = marks_size ? 2 * marks_size : 64;
+          marks = xrealloc(marks, marks_size * sizeof *marks);
+        }
+      }
+      marks[last_mark].position = bytes_in;
+      marks[last_mark].when = now;
+      ++last_mark;
+    }
+  }
+  bytes_in += bytes;
+  for(n = 0; n < noutputs; ++n)
+    if(outputs[n].fd != -1)
+      outputs[n].pending += bytes;
+}
+
+/* return (roughly) when the oldest byte still to be written to O was
+ * read */
+static double oldest(const struct output *o) {
+  unsigned long long position = bytes_in - o->pending;
+  size_t lo = first_mark, hi = last_mark, mid;
+
+  /* find the last mark at or before POSITION.  The first mark is used
+   * even if it's after it. */
+  while(hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if(marks[mid].position <= position)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return marks[lo].when;
+}
+
+/* forget about marks that no output needs any more */
+static void forget_marks(void) {
+  unsigned long long position = bytes_in - queued();
+
+  while(first_mark + 1 < last_mark
+        && marks[first_mark + 1].position <= position)
+    ++first_mark;
+}
+
+#if !HAVE_MEMRCHR
+/* return a pointer to the last C in the N bytes at S, or 0 */
+static void *memrchr(const void *s, int c, size_t n) {
+  const unsigned char *p = (const unsigned char *)s + n;
+
+  while(p > (const unsigned char *)s)
+    if(*--p == (unsigned char)c)
+      return (void *)p;
+  return 0;
+}
+#endif
+
+/* note the arrival of LEN bytes at P, for --line */
+static void scan(const char *p, size_t len) {
+  const char *nl;
+
+  if(!line_mode)
+    return;
+  if((nl = memrchr(p, '\n', len)))
+    record_tail = p + len - nl - 1;
+  else
+    record_tail += len;
+}
+
+/* return how many of output O's pending bytes can be written without
+ * splitting a record */
+static size_t complete(const struct output *o) {
+  size_t partial;
+
+  if(!(line_mode || record_size) || seen_eof)
+    return o->pending;
+  partial = record_size ? bytes_in % record_size : record_tail;
+  if(partial > o->pending)
+    partial = o->pending;
+  /* give up on records that are too long to hold on to */
+  if(partial >= (max_record ? max_record : buffer_size - readmin))
+    return o->pending;
+  return o->pending - partial;
+}
+
+/* return the number of bytes at the start of VECTOR (which has N
+ * elements, and starts at the oldest byte pending for output O) that
+ * make up whole records, up to a maximum of LIMIT.  If there's no
+ * record boundary before LIMIT then the record is split. */
+static size_t whole_records(const struct output *o, const struct iovec *vector,
+                            int n, size_t limit) {
+  unsigned long long start, end;
+  size_t found = 0, done = 0, len;
+  const char *nl;
+  int m;
+
+  if(record_size) {
+    start = bytes_in - o->pending;
+    end = (start + limit) - (start + limit) % record_size;
+    found = end > start ? end - start : 0;
+  } else if(line_mode) {
+    for(m = 0; m < n && done < limit; ++m) {
+      len = vector[m].iov_len < limit - done ? vector[m].iov_len
+                                              : limit - done;
+      if((nl = memrchr(vector[m].iov_base, '\n', len)))
+        found = done + (nl - (const char *)vector[m].iov_base) + 1;
+      done += len;
+    }
+  }
+  return found ? found : limit;
+}
+
+/* pick new read and write sizes if enough has happened since the last
+ * time.  This is a simple hill-climb: keep doubling (or halving) while
+ * the amount moved per second improves, and turn round when it gets
+ * worse.  Only time in system calls would always favour the biggest
+ * size, since fewer calls means less overhead, so the score is taken
+ * over the whole interval. */
+static void adapt(double now) {
+  double score;
+  size_t chunk = writemin;
+
+  if(epoch_calls < EPOCH_CALLS || now - epoch_start < EPOCH_TIME)
+    return;
+  score = epoch_bytes / (now - epoch_start);
+  if(score < last_score)
+    direction = -direction;
+  last_score = score;
+  chunk = direction > 0 ? chunk * 2 : chunk / 2;
+  if(chunk >= adapt_max) {
+    chunk = adapt_max;
+    direction = -1;
+  }
+  if(chunk <= adapt_min) {
+    chunk = adapt_min;
+    direction = 1;
+  }
+  debug("%.0f bytes/s, chunk size now %zu", score, chunk);
+  readmin = writemin = chunk;
+  epoch_start = now;
+  epoch_bytes = 0;
+  epoch_calls = 0;
+}
+
+/* note that a read or write call moved BYTES bytes */
+static void measured(ssize_t bytes) {
+  if(!adaptive)
+    return;
+  if(bytes > 0)
+    epoch_bytes += bytes;
+  ++epoch_calls;
+  adapt(monotime());
+}
+
+/* create a new spill file */
+static struct segment *create_segment(void) {
+  struct segment *seg = xmalloc(sizeof *seg);
+  char *path = xstrdupcat(spill_dir, "/iobuffer.XXXXXX");
+
+  if((seg->fd = mkstemp(path)) < 0)
+    fatale("error creating %s", path);
+  /* the file need only exist as long as it's open, and this way it
+   * can't be left behind */
+  if(unlink(path) < 0)
+    fatale("error removing %s", path);
+  free(path);
+  /* reserve the space now, rather than getting SIGBUS later */
+#if HAVE_POSIX_FALLOCATE
+  if((errno = posix_fallocate(seg->fd, 0, spill_segment)))
+    fatale("error allocating space in %s", spill_dir);
+#else
+  if(ftruncate(seg->fd, spill_segment) < 0)
+    fatale("error allocating space in %s", spill_dir);
+#endif
+  seg->base = mmap(0, spill_segment, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   seg->fd, 0);
+  if(seg->base == MAP_FAILED)
+    fatale("error calling mmap");
+  debug("spilling to a new segment");
+  return seg;
+}
+
+/* add an empty spill file to the end of the list, reusing the spare
+ * one if there is one */
+static struct segment *new_segment(void) {
+  struct segment *seg = spill_spare ? spill_spare : create_segment();
+
+  spill_spare = 0;
+  seg->start = seg->end = 0;
+  seg->next = 0;
+  if(spill_tail)
+    spill_tail->next = seg;
+  else
+    spill_head = seg;
+  spill_tail = seg;
+  return seg;
+}
+
+/* discard the oldest spill file.  One is kept to be reused, since
+ * allocating its space again each time the outputs catch up would be
+ * expensive. */
+static void drop_segment(void) {
+  struct segment *seg = spill_head;
+
+  if(!(spill_head = seg->next))
+    spill_tail = 0;
+  if(!spill_spare) {
+    spill_spare = seg;
+    return;
+  }
+  if(munmap(seg->base, spill_segment) < 0)
+    fatale("error calling munmap");
+  close_e(seg->fd);
+  free(seg);
+}
+
+/* read some data into a spill file */
+static void spill_read(void) {
+  struct segment *seg = spill_tail;
+  ssize_t bytes_read;
+
+  if(!seg || seg->end == spill_segment)
+    seg = new_segment();
+  bytes_read = read(0, seg->base + seg->end, spill_segment - seg->end);
+  ++reads;
+  if(bytes_read > 0) {
+    scan(seg->base + seg->end, bytes_read);
+    seg->end += bytes_read;
+    spill_bytes += bytes_read;
+    added(bytes_read);
+  } else if(!bytes_read)
+    seen_eof = 1;
+  else
+    switch(errno) {
+    case EINTR: break;
+    case EAGAIN: readable = 0; break;
+    default: fatale("error calling read");
+    }
+}
+
+#if HAVE_SPLICE
+/* return true if the internal pipe has room for more data */
+static int pipe_has_room(void) {
+  struct pollfd pfd;
+
+  pfd.fd = internal_pipe[1];
+  pfd.events = POLLOUT;
+  return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLOUT);
+}
+
+/* move some data from stdin into the internal pipe */
+static void splice_read(void) {
+  ssize_t bytes_read;
+
+  bytes_read = splice(0, 0, internal_pipe[1], 0, buffer_size - total_bytes,
+                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  ++reads;
+  if(bytes_read > 0) {
+    total_bytes += bytes_read;
+    added(bytes_read);
+  } else if(!bytes_read)
+    seen_eof = 1;
+  else
+    switch(errno) {
+    case EINTR: break;
+    case EAGAIN:
+      /* either stdin is empty or the internal pipe is full.  Pipes
+       * are accounted in pages rather than bytes, so the latter can
+       * happen before total_bytes reaches buffer_size; if so, flush
+       * what we have before trying again. */
+      if(total_bytes && !pipe_has_room())
+        pipe_full = 1;
+      else
+        readable = 0;
+      break;
+    case EINVAL: stop_zero_copy(); break; /* stdin can't be spliced */
+    default: fatale("error calling splice");
+    }
+}
+#endif
+
+/* hand the job being read into to the workers.  LAST is true at EOF. */
+static void submit(int last) {
+  struct job *j = reading;
+
+  reading = 0;
+  j->next = 0;
+  j->last = last;
+  *jobs_tail = j;
+  jobs_tail = &j->next;
+  ++njobs;
+  codec_submit(j);
+}
+
+/* read some data for the workers */
+static void codec_read(void) {
+  ssize_t bytes_read;
+
+  if(!reading) {
+    reading = xmalloc(sizeof *reading);
+    memset(reading, 0, sizeof *reading);
+    reading->in = xmalloc(block_size);
+  }
+  bytes_read = read(0, reading->in + reading->inlen,
+                    block_size - reading->inlen);
+  measured(bytes_read);
+  ++reads;
+  if(bytes_read > 0) {
+    if(!reading->inlen && max_delay)
+      reading->started = monotime();
+    reading->inlen += bytes_read;
+    raw_bytes += bytes_read;
+    if(reading->inlen == block_size)
+      submit(0);
+  } else if(!bytes_read) {
+    input_eof = 1;
+    /* the decompressor needs to be told about EOF even if there's no
+     * more input, so that it can spot a truncated stream */
+    if(reading->inlen || codec == CODEC_DECOMPRESS)
+      submit(1);
+    else {
+      free(reading->in);
+      free(reading);
+      reading = 0;
+    }
+  } else
+    switch(errno) {
+    case EINTR: break;
+    case EAGAIN: readable = 0; break;
+    default: fatale("error calling read");
+    }
+}
+
+/* submit a partly filled job if it's been waiting too long */
+static void flush_block(void) {
+  if(max_delay && reading && reading->inlen
+     && monotime() - reading->started >= max_delay)
+    submit(0);
+}
+
+/* return the number of bytes collect() may add to the ring */
+static size_t collect_room(void) {
+  size_t room = buffer_size - total_bytes;
+
+  if(lag_policy == LAG_BLOCK && lag_max) {
+    if(queued() >= lag_max)
+      return 0;
+    if(room > lag_max - queued())
+      room = lag_max - queued();
+  }
+  return room;
+}
+
+/* return true if collect() could make progress */
+static int can_collect(void) {
+  return codec && jobs && codec_finished(jobs) && collect_room();
+}
+
+/* move finished jobs' output into the ring, oldest first */
+static void collect(void) {
+  struct job *j;
+  size_t start, n, first;
+
+  while((j = jobs) && codec_finished(j)) {
+    if(j->copied < j->outlen) {
+      if(total_bytes == 0)
+        offset = 0;
+      if(!(n = collect_room()))
+        return;
+      if(n > j->outlen - j->copied)
+        n = j->outlen - j->copied;
+      start = (offset + total_bytes) % buffer_size;
+      first = n;
+      if(!(ring.flags & RING_MIRROR) && start + n > buffer_size)
+        first = buffer_size - start;
+      memcpy(buffer + start, j->out + j->copied, first);
+      memcpy(buffer, j->out + j->copied + first, n - first);
+      if(line_mode) {
+        scan(buffer + start, first);
+        scan(buffer, n - first);
+      }
+      j->copied += n;
+      total_bytes += n;
+      added(n);
+      continue;
+    }
+    if(codec_resume(j))
+      continue;
+    if(!(jobs = j->next))
+      jobs_tail = &jobs;
+    --njobs;
+    free(j->in);
+    free(j->out);
+    free(j);
+  }
+  if(input_eof && !jobs)
+    seen_eof = 1;
 }
 
 /* read some data */
 static void do_read(void) {
   struct iovec vector[2];
   int n;
-  size_t firstgap;
-  int bytes_read;
+  size_t firstgap, left, len;
+  int bytes_read, m;
 
   if(!want_to_read())
     return;
+  if(codec) {
+    codec_read();
+    return;
+  }
+#if HAVE_SPLICE
+  if(zero_copy) {
+    splice_read();
+    return;
+  }
+#endif
+  if(!ring_has_room()) {
+    spill_read();
+    return;
+  }
   n = 0;
   if(total_bytes == 0) {
     /* if the buffer is empty, use it all */
@@ -132,6 +855,11 @@ static void do_read(void) {
     vector[n].iov_base = buffer;
     vector[n].iov_len = buffer_size;
     ++n;
+  } else if(ring.flags & RING_MIRROR) {
+    /* free space that wraps is contiguous in the second mapping */
+    vector[n].iov_base = buffer + (offset + total_bytes) % buffer_size;
+    vector[n].iov_len = buffer_size - total_bytes;
+    ++n;
   } else {
     /* at least readmin bytes available; read whatever's coming */
     firstgap = (offset + total_bytes) % buffer_size; /* start of free space */
@@ -156,69 +884,492 @@ static void do_read(void) {
     }
   }
   bytes_read = readv(0, vector, n);
-  if(bytes_read > 0)
+  measured(bytes_read);
+  ++reads;
+  if(bytes_read > 0) {
     total_bytes += bytes_read;
-  else if(!bytes_read)
+    for(m = 0, left = bytes_read; line_mode && left > 0; left -= len, ++m) {
+      len = vector[m].iov_len < left ? vector[m].iov_len : left;
+      scan(vector[m].iov_base, len);
+    }
+    added(bytes_read);
+  } else if(!bytes_read)
     seen_eof = 1;
   else
     switch(errno) {
-    case EINTR:
-    case EAGAIN: break;
+    case EINTR: break;
+    case EAGAIN: readable = 0; break;
     default: fatale("error calling readv");
     }
 }
 
-/* return true if we want to write */
-static int want_to_write(void) {
+/* return the number of bytes output O needs to be allowed to write
+ * before it's worth writing anything */
+static size_t write_threshold(const struct output *o) {
+  size_t whole = complete(o);
+
+  return whole < writemin ? whole : writemin;
+}
+
+/* top up O's token bucket and return the number of bytes it may write
+ * right now */
+static size_t allowance(struct output *o) {
+  double now;
+
+  if(!rate)
+    return SIZE_MAX;
+  now = monotime();
+  o->tokens += (now - o->refilled) * rate;
+  if(o->tokens > burst)
+    o->tokens = burst;
+  o->refilled = now;
+  return o->tokens;
+}
+
+/* return true if output O has enough data to write, not counting
+ * how long it's been waiting */
+static int enough_to_write(const struct output *o) {
   /* we want to write either if we've seen eof and there's bytes left
    * to write, or if there's at least writemin bytes to write */
-  return (seen_eof && total_bytes > 0) || total_bytes >= writemin;
+  size_t whole = complete(o);
+
+  /* we also have to write if the input has nowhere to go */
+  return (seen_eof && o->pending > 0) || whole >= writemin
+         || (pipe_full && o->pending > 0)
+         || (whole > 0 && !spill_dir && !ring_has_room());
 }
 
-/* write some data */
-static void do_write(void) {
-  struct iovec vector[2];
+/* return true if we want to write to output O */
+static int want_to_write(struct output *o) {
+  if(o->fd == -1 || o->hungup)
+    return 0;
+  /* we want to write if there's enough data, or if the oldest data
+   * has been waiting too long... */
+  if(!enough_to_write(o)
+     && !(max_delay && complete(o) > 0
+          && monotime() - oldest(o) >= max_delay))
+    return 0;
+  /* ...and a rate limit doesn't stop us */
+  return allowance(o) >= write_threshold(o);
+}
+
+/* return how many milliseconds until some output will want to write
+ * without any I/O happening first, or -1 if none will */
+static int wait_timeout(void) {
+  struct output *o;
+  double now, due, wait;
+  int n, ms, timeout = -1;
+
+  if(!rate && !max_delay)
+    return -1;
+  now = monotime();
+  /* a partly filled job must be submitted in time for its data to be
+   * written */
+  if(max_delay && reading && reading->inlen) {
+    due = reading->started + max_delay - now;
+    timeout = due > 0 ? (int)(due * 1000) + 1 : 0;
+  }
+  for(n = 0; n < noutputs; ++n) {
+    o = &outputs[n];
+    if(o->fd == -1 || !o->pending)
+      continue;
+    /* when it'll have waited long enough... */
+    due = 0;
+    if(!enough_to_write(o)) {
+      if(!max_delay)
+        continue;
+      due = oldest(o) + max_delay - now;
+    }
+    /* ...and have enough tokens */
+    if(rate) {
+      allowance(o);
+      if((wait = (write_threshold(o) - o->tokens) / rate) > due)
+        due = wait;
+    }
+    if(due <= 0)
+      continue; /* it's only waiting for the file descriptor */
+    ms = (int)(due * 1000) + 1;
+    if(timeout < 0 || ms < timeout)
+      timeout = ms;
+  }
+  return timeout;
+}
+
+/* VECTOR has N elements; trim it to at most LIMIT bytes and return
+ * the number of elements left */
+static int trim(struct iovec *vector, int n, size_t limit) {
+  int m;
+
+  for(m = 0; m < n && limit > 0; ++m) {
+    if(vector[m].iov_len > limit)
+      vector[m].iov_len = limit;
+    limit -= vector[m].iov_len;
+  }
+  return m;
+}
+
+#if HAVE_SPLICE
+/* move some data from the internal pipe to stdout (which is the only
+ * output in zero-copy mode) */
+static void splice_write(struct output *o) {
+  ssize_t bytes_written;
+  size_t limit = allowance(o);
+
+  bytes_written = splice(internal_pipe[0], 0, o->fd, 0,
+                         total_bytes < limit ? total_bytes : limit,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  ++writes;
+  if(bytes_written > 0) {
+    total_bytes -= bytes_written;
+    o->pending -= bytes_written;
+    o->written += bytes_written;
+    o->tokens -= bytes_written;
+    pipe_full = 0;
+    if(max_delay)
+      forget_marks();
+  } else
+    switch(errno) {
+    case EINTR: break;
+    case EAGAIN: o->writable = 0; break;
+    case EINVAL: stop_zero_copy(); break; /* stdout can't be spliced */
+    default: fatale("error calling splice");
+    }
+}
+#endif
+
+/* fill in VECTOR with the LEN bytes starting at START in the ring and
+ * return the number of elements used (at most 2, or 1 if mirrored) */
+static int ring_data(struct iovec *vector, size_t start, size_t len) {
   int n = 0;
-  size_t end;
-  int bytes_written;
 
-  if(!want_to_write())
-    return;
-  /* we might have one or two chunks to write, depending whether the
-   * text wraps the end of the buffer */
-  end = (offset + total_bytes) % buffer_size; /* end of text */
-  if(end > offset) {
-    /* text does not wrap; we have just one chunk to write */
-    vector[n].iov_base = buffer + offset;
-    vector[n].iov_len = total_bytes;
-    ++n;
-  } else {
+  if(len > 0 && start + len > buffer_size && !(ring.flags & RING_MIRROR)) {
     /* text wraps the buffer; we have two chunks to write */
-    vector[n].iov_base = buffer + offset;
-    vector[n].iov_len = buffer_size - offset;
+    vector[n].iov_base = buffer + start;
+    vector[n].iov_len = buffer_size - start;
     ++n;
     vector[n].iov_base = buffer;
-    vector[n].iov_len = end;
+    vector[n].iov_len = len - (buffer_size - start);
+    ++n;
+  } else if(len > 0) {
+    /* text does not wrap (or the ring is mirrored); we have just one
+     * chunk to write */
+    vector[n].iov_base = buffer + start;
+    vector[n].iov_len = len;
     ++n;
   }
-  bytes_written = writev(1, vector, n);
-  if(bytes_written > 0)
-    total_bytes -= bytes_written;
-  else
+  return n;
+}
+
+/* fill in VECTOR with up to MAX pieces of queued data, skipping the
+ * first SKIP bytes, and return the number of elements used.  MAX must
+ * be at least 2. */
+static int gather(struct iovec *vector, int max, size_t skip) {
+  int n = 0;
+  struct segment *seg;
+  size_t len;
+
+  if(skip < total_bytes) {
+    n = ring_data(vector, (offset + skip) % buffer_size, total_bytes - skip);
+    skip = 0;
+  } else
+    skip -= total_bytes;
+  for(seg = spill_head; seg && n < max; seg = seg->next) {
+    len = seg->end - seg->start;
+    if(skip >= len) {
+      skip -= len;
+      continue;
+    }
+    vector[n].iov_base = seg->base + seg->start + skip;
+    vector[n].iov_len = len - skip;
+    skip = 0;
+    ++n;
+  }
+  return n;
+}
+
+/* discard the oldest BYTES bytes of queued data */
+static void discard(size_t bytes) {
+  struct segment *seg;
+  size_t n;
+
+  /* the ring holds the oldest data, then the spill files */
+  n = bytes < total_bytes ? bytes : total_bytes;
+  offset = (offset + n) % buffer_size;
+  total_bytes -= n;
+  bytes -= n;
+  while(bytes > 0) {
+    seg = spill_head;
+    n = bytes < seg->end - seg->start ? bytes : seg->end - seg->start;
+    seg->start += n;
+    spill_bytes -= n;
+    bytes -= n;
+    /* empty spill files are deleted straight away; once they're all
+     * gone, reads go back to the ring */
+    if(seg->start == seg->end)
+      drop_segment();
+  }
+}
+
+/* discard whatever every output has written */
+static void reclaim(void) {
+  size_t most = 0;
+  int n;
+
+  for(n = 0; n < noutputs; ++n)
+    if(outputs[n].fd != -1 && outputs[n].pending > most)
+      most = outputs[n].pending;
+  discard(queued() - most);
+  if(max_delay)
+    forget_marks();
+}
+
+/* stop writing to output O, discarding whatever it hasn't had */
+static void disconnect(struct evloop *ev, struct output *o) {
+  ev_remove(ev, o->fd);
+  fcntl_e(o->fd, F_SETFL, o->flags);
+  close_e(o->fd);
+  o->fd = -1;
+  o->dropped += o->pending;
+  o->pending = 0;
+  if(!--live_outputs)
+    fatal("all outputs have been disconnected");
+}
+
+/* disconnect outputs whose readers have gone away */
+static void hang_up(struct evloop *ev) {
+  struct output *o;
+  int n, any = 0;
+
+  for(n = 0; n < noutputs; ++n) {
+    o = &outputs[n];
+    if(o->fd != -1 && o->hungup) {
+      error("disconnecting file descriptor %d: broken pipe", o->fd);
+      disconnect(ev, o);
+      any = 1;
+    }
+  }
+  if(any)
+    reclaim();
+}
+
+/* deal with outputs that have fallen more than lag_max bytes behind */
+static void enforce_lag(struct evloop *ev) {
+  struct output *o;
+  int n;
+
+  if(!lag_max || lag_policy == LAG_BLOCK)
+    return;
+  for(n = 0; n < noutputs; ++n) {
+    o = &outputs[n];
+    if(o->fd == -1 || o->pending <= lag_max)
+      continue;
+    if(lag_policy == LAG_DROP) {
+      o->dropped += o->pending - lag_max;
+      o->pending = lag_max;
+    } else {
+      error("disconnecting file descriptor %d: %zu bytes behind", o->fd,
+            o->pending);
+      disconnect(ev, o);
+    }
+  }
+  reclaim();
+}
+
+/* add the first BYTES bytes of VECTOR to the digest */
+static void digest_written(const struct iovec *vector, size_t bytes) {
+  size_t len;
+
+  for(; bytes > 0; bytes -= len, ++vector) {
+    len = vector->iov_len < bytes ? vector->iov_len : bytes;
+    digest_update(digest, vector->iov_base, len);
+  }
+}
+
+/* write some data to output O */
+static void do_write(struct output *o) {
+  struct iovec vector[4];
+  int n;
+  ssize_t bytes_written;
+  size_t limit, whole;
+
+  if(!want_to_write(o))
+    return;
+#if HAVE_SPLICE
+  if(zero_copy) {
+    splice_write(o);
+    return;
+  }
+#endif
+  /* write from the ring, and then from the spill files */
+  n = gather(vector, 4, queued() - o->pending);
+  /* only write whole records, and no more than the rate limit and
+   * atomicity allow */
+  limit = whole = complete(o);
+  if(rate && allowance(o) < limit)
+    limit = allowance(o);
+  if(o->atomic && o->atomic < limit)
+    limit = o->atomic;
+  if(limit < whole)
+    limit = whole_records(o, vector, n, limit);
+  n = trim(vector, n, limit);
+  bytes_written = writev(o->fd, vector, n);
+  measured(bytes_written);
+  ++writes;
+  if(bytes_written > 0) {
+    if(digest && o == outputs)
+      digest_written(vector, bytes_written);
+    o->pending -= bytes_written;
+    /* if a record had to be split, what's left of it starts afresh */
+    if(line_mode && record_tail > o->pending)
+      record_tail = o->pending;
+    o->written += bytes_written;
+    o->tokens -= bytes_written;
+    reclaim();
+  } else
     switch(errno) {
-    case EINTR:
-    case EAGAIN: break;
+    case EINTR: break;
+    case EAGAIN: o->writable = 0; break;
+    case EPIPE:
+      /* with --tee, one reader going away needn't stop the others */
+      if(noutputs > 1) {
+        o->hungup = 1;
+        break;
+      }
+      /* fall through */
     default: fatale("error calling writev");
     }
 }
 
+/* write to each output until it blocks or drops below the minimum
+ * write */
+static void write_all(void) {
+  struct output *o;
+  int n;
+
+  for(n = 0; n < noutputs; ++n) {
+    o = &outputs[n];
+    while(o->writable && want_to_write(o))
+      do_write(o);
+  }
+}
+
+/* return true if any output can make progress */
+static int can_write(void) {
+  int n;
+
+  for(n = 0; n < noutputs; ++n)
+    if(outputs[n].writable && want_to_write(&outputs[n]))
+      return 1;
+  return 0;
+}
+
+/* attribute the time since the last call to the current state of the
+ * buffer */
+static void account(void) {
+  double now, elapsed;
+  size_t q = queued();
+
+  if(stats_fd == -1)
+    return;
+  now = monotime();
+  elapsed = now - accounted;
+  accounted = now;
+  if(!q)
+    time_empty += elapsed;
+  if(pipe_full || !ring_has_room())
+    time_full += elapsed;
+  occupancy[q >= buffer_size ? BUCKETS - 1 : q * (BUCKETS - 1) / buffer_size]
+      += elapsed;
+}
+
+/* write a line of statistics to stats_fd */
+static void report(void) {
+  char line[1024];
+  unsigned long long bytes_out = 0, dropped = 0;
+  double elapsed;
+  size_t len;
+  int n;
+
+  account();
+  for(n = 0; n < noutputs; ++n) {
+    bytes_out += outputs[n].written;
+    dropped += outputs[n].dropped;
+  }
+  elapsed = accounted - started;
+  len = snprintf(line, sizeof line,
+                 "elapsed=%.3f bytes_in=%llu bytes_out=%llu dropped=%llu "
+                 "reads=%lu writes=%lu read_avg=%.0f write_avg=%.0f "
+                 "empty=%.3f full=%.3f occupancy=",
+                 elapsed, bytes_in, bytes_out, dropped, reads, writes,
+                 reads ? (double)bytes_in / reads : 0.0,
+                 writes ? (double)bytes_out / writes : 0.0, time_empty,
+                 time_full);
+  for(n = 0; n < BUCKETS; ++n)
+    len += snprintf(line + len, sizeof line - len, "%s%.3f",
+                    n ? "," : "", elapsed > 0 ? occupancy[n] / elapsed : 0);
+  len += snprintf(line + len, sizeof line - len, "\n");
+  if(writeall(stats_fd, line, len) < 0)
+    fatale("error writing statistics");
+}
+
+/* called on SIGUSR1 when --stats-fd is in use */
+static void stats_signal(int __attribute__((unused)) signo) {
+  stats_wanted = 1;
+}
+
+/* write a report if one has been asked for.  SIGUSR1 is only unblocked
+ * while waiting, so a busy loop would never see it; let any pending
+ * one in here. */
+static void service_stats(void) {
+  sigset_t pending, usr1;
+
+  if(stats_fd == -1)
+    return;
+  if(sigpending(&pending) == 0 && sigismember(&pending, SIGUSR1)) {
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    sigprocmask_e(SIG_UNBLOCK, &usr1, 0);
+    sigprocmask_e(SIG_BLOCK, &usr1, 0);
+  }
+  if(stats_wanted) {
+    stats_wanted = 0;
+    report();
+  }
+}
+
+/* called when a job might have finished */
+static void finished(struct evloop __attribute__((unused)) * ev,
+                     int __attribute__((unused)) fd,
+                     unsigned __attribute__((unused)) events,
+                     void __attribute__((unused)) * u) {
+  codec_drain();
+}
+
+/* called when stdin or an output might have become ready */
+static void ready(struct evloop __attribute__((unused)) * ev, int fd,
+                  unsigned events, void *u) {
+  struct output *o = u;
+
+  if(fd == 0 && (events & EV_READ))
+    readable = 1;
+  if(o && (events & EV_WRITE))
+    o->writable = 1;
+}
+
 int main(int argc, char **argv) {
   int n;
   long value;
+  struct evloop *ev;
+  unsigned long saved;
+  char **fds, **fd;
+  sigset_t waitmask, usr1;
+  struct sigaction sa;
 
   setprogname(argv[0]);
 
-  while((n = getopt_long(argc, argv, "r:w:b:hV", long_options, (int *)0))
+  while((n = getopt_long(argc, argv,
+                         "r:w:b:zs:S:t:l:P:R:B:F:nc:x:A:m:HpLZue:j:k:g:G:dhV",
+                         long_options, (int *)0))
         >= 0) {
     switch(n) {
     case 'V': printf("iobuffer %s\n", VERSION); return 0;
@@ -243,6 +1394,130 @@ int main(int argc, char **argv) {
       buffer_size = value;
       break;
 
+    case 'z': zero_copy = 1; break;
+
+    case 's': spill_dir = optarg; break;
+
+    case 'S':
+      if((value = atol(optarg)) <= 0)
+        fatal("--spill-segment value must be positive");
+      spill_segment = value;
+      break;
+
+    case 't':
+      if(!noutputs)
+        add_output(1);
+      for(fd = fds = split(optarg, ','); *fd; ++fd) {
+        if(!**fd || (*fd)[strspn(*fd, "0123456789")])
+          fatal("invalid file descriptor '%s'", *fd);
+        add_output(atoi(*fd));
+        free(*fd);
+      }
+      free(fds);
+      break;
+
+    case 'l':
+      if((value = atol(optarg)) <= 0)
+        fatal("--lag-max value must be positive");
+      lag_max = value;
+      break;
+
+    case 'P':
+      if((lag_policy = lookup(lag_policies, optarg)) < 0)
+        fatal("unknown --lag-policy '%s'", optarg);
+      break;
+
+    case 'R':
+      if((value = atol(optarg)) <= 0)
+        fatal("--rate value must be positive");
+      rate = value;
+      break;
+
+    case 'B':
+      if((value = atol(optarg)) <= 0)
+        fatal("--burst value must be positive");
+      burst = value;
+      break;
+
+    case 'F':
+      if(!*optarg || optarg[strspn(optarg, "0123456789")])
+        fatal("invalid file descriptor '%s'", optarg);
+      stats_fd = atoi(optarg);
+      fcntl_e(stats_fd, F_GETFL, 0);
+      break;
+
+    case 'n': line_mode = 1; break;
+
+    case 'c':
+      if((value = atol(optarg)) <= 0)
+        fatal("--record-size value must be positive");
+      record_size = value;
+      break;
+
+    case 'x':
+      if((value = atol(optarg)) <= 0)
+        fatal("--max-record value must be positive");
+      max_record = value;
+      break;
+
+    case 'A':
+      fds = split(optarg, ',');
+      if(!fds[0] || !fds[1] || fds[2] || atol(fds[0]) <= 0
+         || atol(fds[1]) < atol(fds[0]))
+        fatal("--adaptive needs MIN,MAX with 0 < MIN <= MAX");
+      adapt_min = atol(fds[0]);
+      adapt_max = atol(fds[1]);
+      adaptive = 1;
+      free(fds[0]);
+      free(fds[1]);
+      free(fds);
+      break;
+
+    case 'm':
+      if((value = atol(optarg)) <= 0)
+        fatal("--max-delay value must be positive");
+      max_delay = value / 1000.0;
+      break;
+
+    case 'H': ring_flags |= RING_HUGE; break;
+    case 'p': ring_flags |= RING_PREFAULT; break;
+    case 'L': ring_flags |= RING_LOCK; break;
+    case 'Z': codec = CODEC_COMPRESS; break;
+    case 'u': codec = CODEC_DECOMPRESS; break;
+
+    case 'e':
+      if(!*optarg || optarg[strspn(optarg, "0123456789")]
+         || (value = atol(optarg)) > 9)
+        fatal("--level value must be between 0 and 9");
+      level = value;
+      break;
+
+    case 'j':
+      if((value = atol(optarg)) <= 0)
+        fatal("--threads value must be positive");
+      threads = value;
+      break;
+
+    case 'k':
+      if((value = atol(optarg)) <= 0)
+        fatal("--block value must be positive");
+      block_size = value;
+      break;
+
+    case 'g':
+      if(!(digest = digest_new(optarg)))
+        fatal("unknown --digest '%s'", optarg);
+      break;
+
+    case 'G':
+      if(!*optarg || optarg[strspn(optarg, "0123456789")])
+        fatal("invalid file descriptor '%s'", optarg);
+      digest_fd = atoi(optarg);
+      fcntl_e(digest_fd, F_GETFL, 0);
+      break;
+
+    case 'd': debugging = 1; break;
+
     default: usage(stderr, 1);
     }
   }
@@ -255,10 +1530,98 @@ int main(int argc, char **argv) {
   if(writemin > buffer_size)
     fatal("--write-min must be smaller than --buffer");
 
-  buffer = xmalloc(buffer_size);
+  if(zero_copy && spill_dir)
+    fatal("--zero-copy and --spill cannot be used together");
+  if(zero_copy && noutputs > 1)
+    fatal("--zero-copy and --tee cannot be used together");
+  if(zero_copy && adaptive)
+    fatal("--zero-copy and --adaptive cannot be used together");
+  if(line_mode && record_size)
+    fatal("--line and --record-size cannot be used together");
+  if((line_mode || record_size) && zero_copy)
+    fatal("--zero-copy cannot be used with --line or --record-size");
+  if((line_mode || record_size) && lag_policy == LAG_DROP)
+    fatal("--lag-policy drop cannot be used with --line or --record-size");
+  if(codec && zero_copy)
+    fatal("--zero-copy cannot be used with --compress or --decompress");
+  if(codec && spill_dir)
+    fatal("--spill cannot be used with --compress or --decompress");
+  if(digest && zero_copy)
+    fatal("--zero-copy and --digest cannot be used together");
+  /* a record that doesn't fit in the ring could never be finished */
+  if(max_record && !spill_dir
+     && max_record > buffer_size - (adaptive ? adapt_max : readmin))
+    fatal("--max-record must be at most --buffer minus %s",
+          adaptive ? "the --adaptive maximum" : "--read-min");
+  if(adaptive) {
+    /* start from the given sizes, within the bounds */
+    if(adapt_max > buffer_size / 2)
+      fatal("--adaptive maximum must be at most half of --buffer");
+    if(writemin < adapt_min)
+      writemin = adapt_min;
+    if(writemin > adapt_max)
+      writemin = adapt_max;
+    readmin = writemin;
+    epoch_start = monotime();
+  }
+
+  if(!noutputs)
+    add_output(1);
+  for(n = 0; n < noutputs; ++n)
+    if(stats_fd == outputs[n].fd)
+      fatal("--stats-fd cannot be an output");
+  if(stats_fd == 0)
+    fatal("--stats-fd cannot be standard input");
+  if(digest)
+    for(n = 0; n < noutputs; ++n)
+      if(digest_fd == outputs[n].fd)
+        fatal("--digest-fd cannot be an output");
+  if(digest && digest_fd == 0)
+    fatal("--digest-fd cannot be standard input");
+  if(line_mode || record_size)
+    /* a write to a pipe is only guaranteed not to be split, or
+     * interleaved with other writers, if it's no bigger than
+     * PIPE_BUF */
+    for(n = 0; n < noutputs; ++n) {
+      struct stat sb;
+
+      if(fstat(outputs[n].fd, &sb) < 0)
+        fatale("error calling fstat");
+      if(S_ISFIFO(sb.st_mode))
+        outputs[n].atomic = PIPE_BUF;
+    }
+  if(rate) {
+    if(!burst)
+      burst = adaptive ? adapt_max : writemin;
+    else if(burst < (adaptive ? adapt_max : writemin))
+      fatal("--burst must be at least --write-min");
+    /* every output starts with a full bucket */
+    for(n = 0; n < noutputs; ++n) {
+      outputs[n].tokens = burst;
+      outputs[n].refilled = monotime();
+    }
+  }
+  /* the buffer may come out bigger than asked for, e.g. rounded up to
+   * whole huge pages, so anything derived from its size comes after */
+  if(zero_copy) {
+    zero_copy = 0;
+    start_zero_copy();
+  }
+  if(!zero_copy)
+    alloc_buffer();
+  /* without somewhere to spill to, dropping or disconnecting must
+   * happen before the ring fills up, or we'd block anyway */
+  if(lag_policy != LAG_BLOCK && !spill_dir) {
+    size_t most = adaptive ? adapt_max : readmin;
+
+    if(!lag_max)
+      lag_max = buffer_size - most;
+    else if(lag_max > buffer_size - most)
+      fatal("--lag-max must be at most --buffer minus %s",
+            adaptive ? "the --adaptive maximum" : "--read-min");
+  }
 
   stdinflags = fcntl_e(0, F_GETFL, 0);
-  stdoutflags = fcntl(1, F_GETFL, 0);
   /* exit() should restore the file flags */
   atexit(restore_flags);
   /* so should fatal signals.  We don't touch the ones that dump core, as the
@@ -267,36 +1630,125 @@ int main(int argc, char **argv) {
    * stop/continue signals too.  */
   fix_fatal_signal(SIGHUP);
   fix_fatal_signal(SIGINT);
-  fix_fatal_signal(SIGPIPE);
+  /* with --tee, a broken pipe only disconnects that output */
+  if(noutputs > 1) {
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = SIG_IGN;
+    sigemptyset(&sa.sa_mask);
+    sigaction_e(SIGPIPE, &sa, 0);
+  } else
+    fix_fatal_signal(SIGPIPE);
   fix_fatal_signal(SIGALRM);
   fix_fatal_signal(SIGTERM);
-  fix_fatal_signal(SIGUSR1);
+  if(stats_fd == -1)
+    fix_fatal_signal(SIGUSR1);
   fix_fatal_signal(SIGUSR2);
+  /* SIGUSR1 asks for a report, but only while we're waiting, so that
+   * it can't interrupt anything else */
+  sigemptyset(&usr1);
+  sigaddset(&usr1, SIGUSR1);
+  sigprocmask_e(SIG_BLOCK, &usr1, &waitmask);
+  if(stats_fd != -1) {
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = stats_signal;
+    sigfillset(&sa.sa_mask);
+    sigaction_e(SIGUSR1, &sa, 0);
+  } else
+    sigprocmask_e(SIG_SETMASK, &waitmask, 0);
+  sigdelset(&waitmask, SIGUSR1);
+  started = accounted = monotime();
 
+  ev = ev_new();
   nonblock(0);
-  nonblock(1);
-
-  do {
-    fd_set readable, writable;
-
-    FD_ZERO(&readable);
-    if(want_to_read())
-      FD_SET(0, &readable);
-    FD_ZERO(&writable);
-    if(want_to_write())
-      FD_SET(1, &writable);
-    if((n = select(2, &readable, &writable, 0, 0)) < 0) {
-      if(errno == EINTR)
-        continue;
-      fatale("error calling select");
-    }
-    if(FD_ISSET(0, &readable))
+  ev_add(ev, 0, EV_READ | EV_EDGE, ready, 0);
+  if(codec) {
+    /* decompression can't be split up, so one worker will do */
+    if(codec == CODEC_DECOMPRESS)
+      threads = 1;
+#if HAVE_SYSCONF && defined _SC_NPROCESSORS_ONLN
+    if(!threads)
+      threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if(threads <= 0)
+      threads = 1;
+    /* keep every worker busy while the next job is read */
+    max_jobs = 2 * threads;
+    ev_add(ev,
+           codec_start(codec == CODEC_DECOMPRESS, level, (int)threads,
+                       buffer_size),
+           EV_READ, finished, 0);
+    debug("%ld %s threads, %zu byte blocks", threads,
+          codec == CODEC_DECOMPRESS ? "decompression" : "compression",
+          block_size);
+  }
+  for(n = 0; n < noutputs; ++n) {
+    nonblock(outputs[n].fd);
+    ev_add(ev, outputs[n].fd, EV_WRITE | EV_EDGE, ready, &outputs[n]);
+  }
+  for(;;) {
+    struct output *o;
+
+    /* read until we run out of input or buffer space, then write
+     * until each output blocks or drops below the minimum write.  If
+     * there are lagging outputs to deal with then only outputs that
+     * are actually stuck should count. */
+    while(readable && want_to_read()) {
       do_read();
-    if(FD_ISSET(1, &writable))
-      do_write();
-    /* keep going while there are bytes left in the buffer, or in the
+      if(lag_max && lag_policy != LAG_BLOCK) {
+        write_all();
+        enforce_lag(ev);
+      }
+    }
+    if(codec) {
+      flush_block();
+      collect();
+    }
+    write_all();
+    hang_up(ev);
+    service_stats();
+    /* stop when there are no bytes left in the buffer, or in the
      * file */
-  } while(!seen_eof || total_bytes);
+    if(seen_eof && !queued())
+      break;
+    /* writing might have made room for another read */
+    if((readable && want_to_read()) || can_write() || can_collect())
+      continue;
+    /* only wait when there's nothing we can do */
+    ev_modify(ev, 0, EV_EDGE | (want_to_read() ? EV_READ : 0));
+    for(n = 0; n < noutputs; ++n) {
+      o = &outputs[n];
+      if(o->fd != -1)
+        ev_modify(ev, o->fd, EV_EDGE | (want_to_write(o) ? EV_WRITE : 0));
+    }
+    account();
+    if(ev_wait(ev, wait_timeout(), stats_fd != -1 ? &waitmask : 0) < 0
+       && errno != EINTR)
+      fatale("error waiting for input or output");
+    account();
+    service_stats();
+  }
+  if(stats_fd != -1)
+    report();
+  if(digest) {
+    char *hex = digest_final(digest);
+
+    if(writeall(digest_fd, hex, strlen(hex)) < 0
+       || writeall(digest_fd, "\n", 1) < 0)
+      fatale("error writing digest");
+    free(hex);
+  }
+  /* a select(2)-style loop would have waited at least once for each
+   * read or write */
+  saved = reads > writes ? reads : writes;
+  saved = saved > ev_waits(ev) ? saved - ev_waits(ev) : 0;
+  debug("%lu reads, %lu writes, %lu waits, %lu waits saved", reads, writes,
+        ev_waits(ev), saved);
+  if(codec)
+    debug("%llu bytes read, %llu bytes after %s", raw_bytes, bytes_in,
+          codec == CODEC_DECOMPRESS ? "decompression" : "compression");
+  for(n = 0; n < noutputs; ++n)
+    debug("output %d: %llu bytes written, %llu dropped", n,
+          outputs[n].written, outputs[n].dropped);
   /* atexit callback will restore flags */
   return 0;
 }
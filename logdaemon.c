@@ -34,25 +34,110 @@
 #include <fcntl.h>
 #include <glob.h>
 #include <assert.h>
+#include <poll.h>
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #define SYSLOG_NAMES
 #include <syslog.h>
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
 #include "utils.h"
+#include "uio.h"
+#include "evloop.h"
+#include "spsc.h"
 #include "logdaemon.h"
 
-#define SUSPEND_PERIOD 60 /* how long to suspend inputs for */
-#define SELECT_RESOLUTION                                                      \
-  10 /* upper limit to select                                                  \
-      * timeout if there are                                                   \
-      * suspended inputs */
-
 struct logfile *ld_logfiles;       /* linked list of logfiles */
 struct syslogfile *ld_syslogfiles; /* linked list of syslogfiles */
 struct input *ld_inputs;           /* linked list of inputs */
 long ld_day = 86400;               /* seconds between rotations */
+size_t ld_bufsize = 65536;         /* size of each input's buffer */
+size_t ld_backlog = 1048576;       /* default backlog limit */
+int ld_overflow = LD_BLOCK;        /* default overflow policy */
+long ld_retry = 60;                /* seconds to suspend inputs for */
+
+const struct ld_codec ld_codecs[] = {
+    {"gzip", ".gz", 0},       {"bzip2", ".bz2", 0},    {"xz", ".xz", 0},
+    {"zstd", ".zst", "--rm"}, {"lz4", ".lz4", "--rm"}, {0, 0, 0}};
+
+const struct ld_codec *ld_codec = &ld_codecs[0]; /* compressor */
+int ld_level;                                    /* compression level */
+int ld_compressors = 1;                          /* compressors at once */
+
+size_t ld_member_size = 1048576; /* bytes per live gzip member */
+long ld_member_interval = 10;    /* seconds per live gzip member */
+
+const char *ld_index; /* index of created files, or 0 */
+int ld_rescan;        /* true to rebuild the index */
+
+int ld_writers; /* writer threads for ld_loop */
+
+/* the event loop only exists while ld_loop() is running, so that
+ * callers can fork between setting up inputs and calling it */
+static struct evloop *ev; /* event loop, or 0 */
+
+/* suspended inputs, in the order they were suspended, which is also
+ * the order they're due to be resumed in */
+static struct input *suspended_head, **suspended_tail = &suspended_head;
+static int suspended; /* number of suspended inputs */
+
+static struct logfile *dirty; /* logfiles with pending inputs */
+
+/* inputs with daily callbacks, as a heap ordered by due */
+static struct input **timers;
+static size_t ntimers, timers_size;
+
+/* a file in the index */
+struct ld_entry {
+  struct ld_entry *next;        /* next newer file */
+  char *path;                   /* path it was created with */
+  const struct ld_codec *codec; /* what it's compressed with, or 0 */
+  time_t time;                  /* when it was created or last in use */
+  int compressing;              /* true while it's being compressed */
+};
+
+/* a file to compress */
+struct compression {
+  struct compression *next; /* next in queue */
+  char *path;               /* file to compress */
+  pid_t pid;                /* compressor, or -1 if not started */
+  int fd;                   /* closed when the compressor exits */
+  struct logfile *log;      /* logfile it belongs to, or 0 */
+  struct ld_entry *entry;   /* its index entry, or 0 */
+};
+
+/* a write of a logfile's backlog and its pending inputs' data */
+struct ld_batch {
+  struct logfile *log;      /* logfile to write to */
+  struct iovec *iov;        /* what to write */
+  size_t n;                 /* elements in iov */
+  size_t nbacklog;          /* leading elements that are the backlog */
+  size_t start;             /* first element not completely written */
+  size_t done;              /* bytes written */
+  size_t queued;            /* the logfile's queued bytes that are in it */
+  struct input *inputs;     /* inputs whose data it is */
+  int failed;               /* true if writing failed */
+  int error;                /* errno value to report, or 0 */
+  struct iovec *copy;       /* writer thread's copy of iov */
+  size_t copysize;          /* size of copy */
+  struct ld_writer *thread; /* writer thread */
+  int busy;                 /* true while the thread has it */
+};
+
+static struct compression *compressions; /* waiting or running */
+static int compressing;                  /* number running */
+
+static int index_fd = -1; /* index being appended to, or -1 */
+
+static void start_compressors(void);
+static void open_index(void);
+static void settle(struct logfile *l);
+static void flush(struct logfile *l, struct timeval now);
 
-static fd_set fds;        /* input FD set for select */
-static int maxinput = -1; /* max selectable FD */
-static int suspended;     /* number of suspended inputs */
+/* logfiles with open gzip members, oldest member first */
+static struct logfile *members, **members_tail = &members;
 
 /* block all signals, save the old signal mask via SS */
 
@@ -86,13 +171,45 @@ struct logfile *ld_new_logfile(const char *pattern) {
   l = xmalloc(sizeof *l);
   l->pattern = xstrdup(pattern);
   l->path = 0;
+  l->base = 0;
+  l->segment = 0;
+  l->size = 0;
+  l->max_size = 0;
+  l->valid_from = l->valid_until = 0;
   l->fd = -1;
   l->date = -1;
   l->rotate = 0;
   l->compress = 0;
   l->usegmt = 1;
-  l->buffer = 0;
-  l->bufsize = 0;
+  memset(&l->backlog, 0, sizeof l->backlog);
+  l->backlog_start = 0;
+  l->backlog_bytes = 0;
+  l->backlog_max = ld_backlog;
+  l->overflow = ld_overflow;
+  l->dropped = 0;
+  l->queued = 0;
+  l->pending = 0;
+  l->pending_tail = &l->pending;
+  l->next_dirty = 0;
+  l->stream = 0;
+  l->member = 0;
+  l->member_started = 0;
+  l->member_bytes = 0;
+  l->zbuf = 0;
+  l->zbytes = l->zsize = 0;
+  l->zstarted = 0;
+  l->next_member = 0;
+  l->entries = 0;
+  l->entries_tail = &l->entries;
+  l->uncompressed = 0;
+  l->schedule = LD_EVERY_DAY;
+  l->schedule_at = 0;
+  l->prefix = 0;
+  l->stamp_sec = 0;
+  l->stamp_len = l->stamp_frac = 0;
+  l->writer = -1;
+  l->batch = 0;
+  l->stalled = 0;
   l->next = ld_logfiles;
   l->refs = 1;
   ld_logfiles = l;
@@ -102,6 +219,8 @@ struct logfile *ld_new_logfile(const char *pattern) {
 
 void ld_delete_logfile(struct logfile *l) {
   struct logfile **ll;
+  struct compression *c;
+  struct ld_entry *e;
   sigset_t ss;
 
   block(&ss);
@@ -110,11 +229,26 @@ void ld_delete_logfile(struct logfile *l) {
       ;
     if(*ll)
       *ll = l->next;
-    if(l->fd != -1)
-      close(l->fd);
+    ld_close_logfile(l);
+    if(l->batch) {
+      free(l->batch->copy);
+      free(l->batch);
+    }
     free(l->pattern);
     free(l->path);
-    free(l->buffer);
+    free(l->base);
+    if(l->backlog.base)
+      ring_free(&l->backlog);
+    free(l->zbuf);
+    /* compressions outlive the index entries they refer to */
+    for(c = compressions; c; c = c->next)
+      if(c->log == l)
+        c->log = 0, c->entry = 0;
+    while((e = l->entries)) {
+      l->entries = e->next;
+      free(e->path);
+      free(e);
+    }
     free(l);
   }
   unblock(&ss);
@@ -173,44 +307,852 @@ void ld_delete_syslogfile(struct syslogfile *l) {
   unblock(&ss);
 }
 
+/* called when input U is readable */
+static void input_ready(struct evloop __attribute__((unused)) * e,
+                        int __attribute__((unused)) fd,
+                        unsigned __attribute__((unused)) events, void *u) {
+  struct input *i = u;
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  (*i->input_callback)(i, now);
+}
+
+/* return the events to watch input I for.  A stalled input is still
+ * readable, but can't be read until its logfile has been written, so
+ * it isn't watched until then. */
+static unsigned wanted(const struct input *i) {
+  return i->suspended.tv_sec || i->in_flight || i->stalled_on || i->deleted
+             ? 0
+             : EV_READ;
+}
+
+/* start watching input I */
+static void watch(struct input *i) {
+  if(ev && i->fd != -1)
+    ev_add(ev, i->fd, wanted(i), input_ready, i);
+  if(ev && i->hangup_fd != -1)
+    ev_add(ev, i->hangup_fd, wanted(i), input_ready, i);
+}
+
+/* bring the events input I is watched for up to date */
+static void rewatch(struct input *i) {
+  if(ev && i->fd != -1)
+    ev_modify(ev, i->fd, wanted(i));
+  if(ev && i->hangup_fd != -1)
+    ev_modify(ev, i->hangup_fd, wanted(i));
+}
+
+/* remove I from the suspended list */
+static void unsuspend(struct input *i) {
+  struct input **ii;
+
+  for(ii = &suspended_head; *ii != i; ii = &(*ii)->next_suspended)
+    ;
+  if(!(*ii = i->next_suspended))
+    suspended_tail = ii;
+  i->suspended.tv_sec = i->suspended.tv_usec = 0;
+  --suspended;
+}
+
+/* stop watching input I until its logfile has been written */
+static void stall(struct input *i) {
+  struct logfile *l = i->log;
+
+  if(!i->stalled_on) {
+    i->stalled_on = l;
+    i->next_stalled = l->stalled;
+    l->stalled = i;
+    rewatch(i);
+  }
+}
+
+/* start watching the inputs stalled on L again */
+static void unstall(struct logfile *l) {
+  struct input *i;
+
+  while((i = l->stalled)) {
+    l->stalled = i->next_stalled;
+    i->next_stalled = 0;
+    i->stalled_on = 0;
+    rewatch(i);
+  }
+}
+
+/* describe the backlog for L in VECTOR, returning the number of
+ * elements used (at most 2) */
+static int backlog_data(struct logfile *l, struct iovec *vector) {
+  size_t first;
+
+  if(!l->backlog_bytes)
+    return 0;
+  first = l->backlog.size - l->backlog_start;
+  if((l->backlog.flags & RING_MIRROR) || first >= l->backlog_bytes)
+    first = l->backlog_bytes;
+  vector[0].iov_base = l->backlog.base + l->backlog_start;
+  vector[0].iov_len = first;
+  if(first == l->backlog_bytes)
+    return 1;
+  vector[1].iov_base = l->backlog.base;
+  vector[1].iov_len = l->backlog_bytes - first;
+  return 2;
+}
+
+/* discard the oldest BYTES bytes of L's backlog */
+static void backlog_consume(struct logfile *l, size_t bytes) {
+  l->backlog_bytes -= bytes;
+  l->backlog_start = l->backlog_bytes
+                         ? (l->backlog_start + bytes) % l->backlog.size
+                         : 0;
+}
+
+/* add LEN bytes at P to L's backlog, discarding data according to
+ * L's overflow policy if there's not enough room */
+static void backlog_append(struct logfile *l, const char *p, size_t len) {
+  size_t room, drop = 0, end, first;
+
+  if(!l->backlog.base)
+    ring_alloc(&l->backlog, l->backlog_max, RING_MIRROR);
+  room = l->backlog_max - l->backlog_bytes;
+  if(len > room) {
+    drop = len - room;
+    if(l->overflow == LD_DROP_OLDEST) {
+      /* make room, and if that's not enough, keep the end of P */
+      if(drop > l->backlog_bytes) {
+        p += drop - l->backlog_bytes;
+        len -= drop - l->backlog_bytes;
+        backlog_consume(l, l->backlog_bytes);
+      } else
+        backlog_consume(l, drop);
+    } else
+      len = room; /* LD_BLOCK should never get here */
+    l->dropped += drop;
+  }
+  end = (l->backlog_start + l->backlog_bytes) % l->backlog.size;
+  first = len;
+  if(!(l->backlog.flags & RING_MIRROR) && end + len > l->backlog.size)
+    first = l->backlog.size - end;
+  memcpy(l->backlog.base + end, p, first);
+  memcpy(l->backlog.base, p + first, len - first);
+  l->backlog_bytes += len;
+  if(drop)
+    error("%s: backlog full, dropped %zu bytes (%llu in total)", l->pattern,
+          drop, l->dropped);
+}
+
+#if HAVE_ZLIB
+/* write out L's compressed data.  Returns 0 on success and -1 on
+ * error, in which case whatever wasn't written is kept.  Once part of
+ * it has been written, the rest can only go to the same file. */
+static int zwrite(struct logfile *l) {
+  size_t done = 0;
+  ssize_t n;
+
+  while(done < l->zbytes) {
+    if((n = write(l->fd, l->zbuf + done, l->zbytes - done)) < 0) {
+      if(errno == EINTR)
+        continue;
+      errore("error writing to %s", l->path);
+      memmove(l->zbuf, l->zbuf + done, l->zbytes -= done);
+      if(done)
+        l->zstarted = 1;
+      return -1;
+    }
+    done += n;
+    l->size += n;
+  }
+  l->zbytes = 0;
+  l->zstarted = 0;
+  return 0;
+}
+
+/* L's file is about to be closed.  Compressed data that has been
+ * partly written to it can't go anywhere else, so whatever of it is
+ * still left is discarded. */
+static void zabandon(struct logfile *l) {
+  if(!l->zstarted)
+    return;
+  error("%s: discarding %zu bytes of compressed data", l->path, l->zbytes);
+  l->zbytes = 0;
+  l->zstarted = 0;
+}
+
+/* compress whatever's waiting to go into L's member, with deflate
+ * flush mode FLUSH */
+static void deflate_member(struct logfile *l, int flush) {
+  z_stream *z = l->member;
+  int rc;
+
+  do {
+    if(l->zsize - l->zbytes < 16384)
+      l->zbuf = xrealloc(l->zbuf, l->zsize = 2 * l->zsize + 65536);
+    z->next_out = (Bytef *)l->zbuf + l->zbytes;
+    z->avail_out = l->zsize - l->zbytes;
+    if((rc = deflate(z, flush)) == Z_STREAM_ERROR)
+      fatal("error calling deflate");
+    l->zbytes = l->zsize - z->avail_out;
+  } while(flush == Z_FINISH ? rc != Z_STREAM_END
+                            : z->avail_in > 0 || z->avail_out == 0);
+}
+
+/* start a new gzip member for L */
+static void start_member(struct logfile *l, time_t now) {
+  z_stream *z = xmalloc(sizeof *z);
+
+  memset(z, 0, sizeof *z);
+  /* 16 + 15 means a gzip wrapper round a 32KB window */
+  if(deflateInit2(z, ld_level ? ld_level : Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                  16 + 15, 8, Z_DEFAULT_STRATEGY)
+     != Z_OK)
+    fatal("error calling deflateInit2");
+  l->member = z;
+  l->member_started = now;
+  l->member_bytes = 0;
+  l->next_member = 0;
+  *members_tail = l;
+  members_tail = &l->next_member;
+}
+
+/* finish L's member, if it has one, and write it out if the file is
+ * open */
+static void finish_member(struct logfile *l) {
+  struct logfile **ll;
+
+  if(!l->member)
+    return;
+  deflate_member(l, Z_FINISH);
+  deflateEnd(l->member);
+  free(l->member);
+  l->member = 0;
+  for(ll = &members; *ll != l; ll = &(*ll)->next_member)
+    ;
+  if(!(*ll = l->next_member))
+    members_tail = ll;
+  if(l->fd != -1)
+    zwrite(l);
+}
+
+/* compress the N elements of VECTOR into L's gzip member, finishing
+ * the member and writing it out if it's big or old enough.  *DONE is
+ * set to the number of bytes consumed: all of them, unless compressed
+ * data from last time still can't be written.  Returns -1 on a write
+ * error. */
+static int stream_write(struct logfile *l, const struct iovec *vector,
+                        size_t n, time_t now, size_t *done) {
+  z_stream *z;
+  size_t k;
+
+  if(l->zbytes && zwrite(l) < 0)
+    return -1;
+  if(!l->member)
+    start_member(l, now);
+  z = l->member;
+  for(k = 0; k < n; ++k) {
+    z->next_in = vector[k].iov_base;
+    z->avail_in = vector[k].iov_len;
+    deflate_member(l, Z_NO_FLUSH);
+    *done += vector[k].iov_len;
+    l->member_bytes += vector[k].iov_len;
+  }
+  if(l->member_bytes >= ld_member_size
+     || now >= l->member_started + ld_member_interval) {
+    finish_member(l);
+    return l->zbytes ? -1 : 0;
+  }
+  return 0;
+}
+#else
+static void finish_member(struct logfile __attribute__((unused)) * l) {
+}
+
+static void zabandon(struct logfile __attribute__((unused)) * l) {
+}
+
+static int stream_write(struct logfile __attribute__((unused)) * l,
+                        const struct iovec __attribute__((unused)) * vector,
+                        size_t __attribute__((unused)) n,
+                        time_t __attribute__((unused)) now,
+                        size_t __attribute__((unused)) * done) {
+  fatal("compressed log files are not supported on this platform");
+}
+#endif
+
+/* finish gzip members that are old enough, or all of them if ALL is
+ * set */
+static void expire_members(struct timeval now, int all) {
+  struct logfile *l;
+
+  while((l = members)
+        && (all || now.tv_sec >= l->member_started + ld_member_interval)) {
+    /* the member goes wherever the data in it would have gone */
+    ld_open_logfile(l, now);
+    finish_member(l);
+  }
+}
+
+static struct iovec *iov; /* vector for flush() */
+static size_t iovsize;    /* size of iov */
+
+/* make sure iov has at least N elements, and return it */
+static struct iovec *need_iov(size_t n) {
+  if(n > iovsize)
+    iov = xrealloc(iov, (iovsize = n > 2 * iovsize ? n : 2 * iovsize)
+                            * sizeof *iov);
+  return iov;
+}
+
+/* add input I's data to iov, starting at element N, with its prefix at
+ * the start of each line.  Returns the new number of elements. */
+static size_t prefixed_data(struct input *i, size_t n) {
+  char *p = i->buffer, *end = i->buffer + i->bytes, *nl;
+  int midline = i->buffer_midline;
+
+  while(p < end) {
+    if(!midline) {
+      need_iov(n + 1)[n].iov_base = i->prefix;
+      iov[n++].iov_len = i->prefix_len;
+    }
+    nl = memchr(p, '\n', end - p);
+    need_iov(n + 1)[n].iov_base = p;
+    iov[n++].iov_len = (nl ? nl + 1 : end) - p;
+    midline = !nl;
+    p = nl ? nl + 1 : end;
+  }
+  return n;
+}
+
+/* take L off the dirty list, if it's there */
+static void undirty(struct logfile *l) {
+  struct logfile **ll;
+
+  for(ll = &dirty; *ll && *ll != l; ll = &(*ll)->next_dirty)
+    ;
+  if(*ll)
+    *ll = l->next_dirty;
+}
+
+/* gather up L's backlog, then each pending input's data, in order,
+ * into B.  B's iov is the static iov. */
+static void gather(struct logfile *l, struct ld_batch *b) {
+  struct input *i;
+  size_t n;
+
+  undirty(l);
+  n = b->nbacklog = backlog_data(l, need_iov(2));
+  for(i = l->pending; i; i = i->next_pending) {
+    if(i->shm)
+      n += shmring_iov(i->shm, i->bytes, need_iov(n + 2) + n);
+    else if(i->prefix_len)
+      n = prefixed_data(i, n);
+    else {
+      need_iov(n + 1)[n].iov_base = i->buffer;
+      iov[n++].iov_len = i->bytes;
+    }
+  }
+  b->log = l;
+  b->iov = iov;
+  b->n = n;
+  b->start = b->done = 0;
+  b->queued = l->queued;
+  b->inputs = l->pending;
+  b->failed = b->error = 0;
+  l->pending = 0;
+  l->pending_tail = &l->pending;
+}
+
+/* write B to its logfile's open file with as few system calls as
+ * possible.  This is all that writer threads do, so it doesn't touch
+ * anything else. */
+static void write_batch(struct ld_batch *b) {
+  struct logfile *l = b->log;
+  size_t count;
+  ssize_t written;
+
+  while(b->start < b->n) {
+    count = b->n - b->start < IOV_MAX ? b->n - b->start : IOV_MAX;
+    if((written = writev(l->fd, b->iov + b->start, count)) < 0) {
+      if(errno == EINTR)
+        continue;
+      b->error = errno;
+      b->failed = 1;
+      break;
+    }
+    /* skip what was written */
+    b->done += written;
+    l->size += written;
+    while(b->start < b->n && (size_t)written >= b->iov[b->start].iov_len)
+      written -= b->iov[b->start++].iov_len;
+    if(b->start < b->n) {
+      b->iov[b->start].iov_base = (char *)b->iov[b->start].iov_base + written;
+      b->iov[b->start].iov_len -= written;
+    }
+  }
+}
+
+/* tidy up after writing B.  Whatever wasn't written goes into the
+ * backlog, and the inputs concerned are suspended. */
+static void finish(struct ld_batch *b) {
+  struct logfile *l = b->log;
+  struct input *i;
+  size_t skip, start;
+
+  if(b->error) {
+    errno = b->error;
+    errore("error writing to %s", l->path);
+  }
+  /* the backlog went first */
+  skip = b->done < l->backlog_bytes ? b->done : l->backlog_bytes;
+  backlog_consume(l, skip);
+  /* anything left of the inputs' data goes into the backlog.  What's
+   * left of the first unwritten iovec has already been adjusted. */
+  for(start = b->start > b->nbacklog ? b->start : b->nbacklog; start < b->n;
+      ++start)
+    backlog_append(l, b->iov[start].iov_base, b->iov[start].iov_len);
+  while((i = b->inputs)) {
+    b->inputs = i->next_pending;
+    i->next_pending = 0;
+    i->pending_on = 0;
+    if(i->shm)
+      shmring_consume(i->shm, i->bytes);
+    i->bytes = 0;
+    i->in_flight = 0;
+    if(i->deleted)
+      ld_delete_input(i);
+    else if(b->failed)
+      ld_suspend_input(i);
+    else
+      rewatch(i);
+  }
+  l->queued -= b->queued;
+  if(b->failed)
+    ld_close_logfile(l);
+  unstall(l);
+}
+
+#if HAVE_PTHREAD
+/* a thread that writes logfiles for ld_loop */
+struct ld_writer {
+  pthread_t id;         /* thread ID */
+  struct spsc requests; /* batches to write */
+  struct spsc written;  /* batches it has written */
+  int wake[2];          /* pipe to wake it up */
+  int stop;             /* set to make it exit */
+};
+
+static struct ld_writer *writers; /* writer threads */
+static int nwriters;              /* number of writer threads */
+static int written_fd[2] = {-1, -1}; /* pipe for them to wake ld_loop */
+
+/* the main loop of writer thread U */
+static void *writer_main(void *u) {
+  struct ld_writer *w = u;
+  struct ld_batch *b;
+  char buffer[64];
+
+  for(;;) {
+    while((b = spsc_pop(&w->requests))) {
+      write_batch(b);
+      /* there's room, since each logfile has only one batch */
+      spsc_push(&w->written, b);
+      if(write(written_fd[1], "", 1) < 0 && errno != EAGAIN)
+        fatale("error writing to pipe");
+    }
+    if(__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE))
+      return 0;
+    /* a byte arrives after each request, so none can be missed */
+    if(read(w->wake[0], buffer, sizeof buffer) < 0 && errno != EINTR)
+      fatale("error reading from pipe");
+  }
+}
+
+/* add L to the dirty list, if it's not already there */
+static void redirty(struct logfile *l) {
+  struct logfile *d;
+
+  for(d = dirty; d && d != l; d = d->next_dirty)
+    ;
+  if(!d) {
+    l->next_dirty = dirty;
+    dirty = l;
+  }
+}
+
+/* finish the batches that the writer threads have written */
+static void reap(void) {
+  struct ld_batch *b;
+  char buffer[64];
+  int n;
+
+  while(read(written_fd[0], buffer, sizeof buffer) > 0)
+    ;
+  for(n = 0; n < nwriters; ++n)
+    while((b = spsc_pop(&writers[n].written))) {
+      b->busy = 0;
+      finish(b);
+      /* data that arrived meanwhile was left for now */
+      if(b->log->pending)
+        redirty(b->log);
+    }
+}
+
+/* called when a writer thread has finished a batch */
+static void written(struct evloop __attribute__((unused)) * e,
+                    int __attribute__((unused)) fd,
+                    unsigned __attribute__((unused)) events,
+                    void __attribute__((unused)) * u) {
+  reap();
+}
+
+/* wait until L isn't being written by a writer thread */
+static void settle(struct logfile *l) {
+  struct pollfd pfd;
+
+  while(l->batch && l->batch->busy) {
+    pfd.fd = written_fd[0];
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, -1) < 0 && errno != EINTR)
+      fatale("error calling poll");
+    reap();
+  }
+}
+
+/* hand everything pending for L, and its backlog, to L's writer
+ * thread.  The inputs concerned aren't read any further until it's
+ * been written. */
+static void hand_off(struct logfile *l, struct timeval now) {
+  struct ld_batch *b = l->batch;
+  struct input *i;
+
+  if(b->busy) {
+    /* reap() will put it back.  Meanwhile the inputs with data
+     * waiting aren't read any further. */
+    undirty(l);
+    for(i = l->pending; i; i = i->next_pending)
+      stall(i);
+    return;
+  }
+  gather(l, b);
+  if(!(b->failed = ld_open_logfile(l, now) < 0) && b->n) {
+    /* the static iov will be reused before the thread is done */
+    if(b->n > b->copysize)
+      b->copy = xrealloc(b->copy, (b->copysize = b->n) * sizeof *b->copy);
+    b->iov = memcpy(b->copy, b->iov, b->n * sizeof *b->copy);
+    for(i = b->inputs; i; i = i->next_pending) {
+      i->in_flight = 1;
+      rewatch(i);
+    }
+    b->busy = 1;
+    spsc_push(&b->thread->requests, b);
+    if(write(b->thread->wake[1], "", 1) < 0 && errno != EAGAIN)
+      fatale("error writing to pipe");
+    return;
+  }
+  finish(b);
+}
+
+/* start ld_writers writer threads, and share out the logfiles between
+ * them */
+static void start_writers(void) {
+  struct logfile *l;
+  struct ld_writer *w;
+  size_t *counts;
+  int n, next = 0, rc;
+
+  if(ld_writers <= 0)
+    return;
+  nwriters = ld_writers;
+  writers = xmalloc(nwriters * sizeof *writers);
+  counts = xmalloc(nwriters * sizeof *counts);
+  memset(counts, 0, nwriters * sizeof *counts);
+  for(l = ld_logfiles; l; l = l->next) {
+    /* streaming shares state between logfiles, so those stay here */
+    if(l->stream)
+      continue;
+    n = (l->writer >= 0 ? l->writer : next++) % nwriters;
+    l->batch = xmalloc(sizeof *l->batch);
+    memset(l->batch, 0, sizeof *l->batch);
+    l->batch->thread = &writers[n];
+    ++counts[n];
+  }
+  pipe_e(written_fd);
+  for(n = 0; n < 2; ++n) {
+    cloexec(written_fd[n]);
+    nonblock(written_fd[n]);
+  }
+  ev_add(ev, written_fd[0], EV_READ, written, 0);
+  /* the threads inherit ld_loop's signal mask, which blocks
+   * everything */
+  for(n = 0; n < nwriters; ++n) {
+    w = &writers[n];
+    spsc_init(&w->requests, counts[n]);
+    spsc_init(&w->written, counts[n]);
+    pipe_e(w->wake);
+    cloexec(w->wake[0]);
+    cloexec(w->wake[1]);
+    nonblock(w->wake[1]);
+    w->stop = 0;
+    if((rc = pthread_create(&w->id, 0, writer_main, w)))
+      fatal("error calling pthread_create: %s", strerror(rc));
+  }
+  free(counts);
+}
+
+/* wait for everything to be written and stop the writer threads */
+static void stop_writers(void) {
+  struct logfile *l;
+  struct ld_writer *w;
+  int n;
+
+  if(!nwriters)
+    return;
+  for(l = ld_logfiles; l; l = l->next)
+    if(l->batch) {
+      settle(l);
+      free(l->batch->copy);
+      free(l->batch);
+      l->batch = 0;
+    }
+  for(n = 0; n < nwriters; ++n) {
+    w = &writers[n];
+    __atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+    if(write(w->wake[1], "", 1) < 0 && errno != EAGAIN)
+      fatale("error writing to pipe");
+    pthread_join(w->id, 0);
+    spsc_free(&w->requests);
+    spsc_free(&w->written);
+    close(w->wake[0]);
+    close(w->wake[1]);
+  }
+  ev_remove(ev, written_fd[0]);
+  close(written_fd[0]);
+  close(written_fd[1]);
+  written_fd[0] = written_fd[1] = -1;
+  free(writers);
+  writers = 0;
+  nwriters = 0;
+}
+#else
+static void settle(struct logfile __attribute__((unused)) * l) {
+}
+
+static void hand_off(struct logfile *l, struct timeval now) {
+  flush(l, now);
+}
+
+static void start_writers(void) {
+}
+
+static void stop_writers(void) {
+}
+#endif
+
+/* write everything pending for L, and its backlog, and wait for it to
+ * be written.  Whatever can't be written goes into the backlog, and
+ * the inputs concerned are suspended. */
+static void flush(struct logfile *l, struct timeval now) {
+  struct ld_batch b;
+
+  settle(l);
+  gather(l, &b);
+  if(!(b.failed = ld_open_logfile(l, now) < 0)) {
+    if(l->stream) {
+      b.failed = stream_write(l, b.iov, b.n, now.tv_sec, &b.done) < 0;
+      b.start = b.done ? b.n : 0;
+    } else
+      write_batch(&b);
+  }
+  finish(&b);
+}
+
+/* write out every logfile with pending inputs, in writer threads
+ * where they have them */
+static void flush_all(void) {
+  struct timeval now;
+
+  if(dirty) {
+    gettimeofday(&now, NULL);
+    while(dirty) {
+      if(dirty->batch)
+        hand_off(dirty, now);
+      else
+        flush(dirty, now);
+    }
+  }
+}
+
+/* move the timer at position N towards the top of the heap until it's
+ * in the right place */
+static void timer_up(size_t n) {
+  struct input *i = timers[n];
+
+  while(n > 0 && tvcmp(&i->due, &timers[(n - 1) / 2]->due) < 0) {
+    timers[n] = timers[(n - 1) / 2];
+    timers[n]->timer = n;
+    n = (n - 1) / 2;
+  }
+  timers[n] = i;
+  i->timer = n;
+}
+
+/* move the timer at position N towards the bottom of the heap until
+ * it's in the right place */
+static void timer_down(size_t n) {
+  struct input *i = timers[n];
+  size_t c;
+
+  while((c = 2 * n + 1) < ntimers) {
+    if(c + 1 < ntimers && tvcmp(&timers[c + 1]->due, &timers[c]->due) < 0)
+      ++c;
+    if(tvcmp(&timers[c]->due, &i->due) >= 0)
+      break;
+    timers[n] = timers[c];
+    timers[n]->timer = n;
+    n = c;
+  }
+  timers[n] = i;
+  i->timer = n;
+}
+
+/* return when input I's daily callback should next run, after NOW */
+static struct timeval next_due(const struct input *i, struct timeval now) {
+  if(i->daily_callback == ld_daily_callback)
+    return ld_next_scheduled(i->log, now);
+  return ld_next_daily(now);
+}
+
+/* add input I to the timer heap, if it has a daily callback */
+static void add_timer(struct input *i) {
+  struct timeval now;
+
+  if(!i->daily_callback)
+    return;
+  gettimeofday(&now, NULL);
+  i->due = next_due(i, now);
+  if(ntimers >= timers_size)
+    timers = xrealloc(timers, (timers_size = timers_size ? 2 * timers_size : 16)
+                                  * sizeof *timers);
+  timers[ntimers] = i;
+  timer_up(ntimers++);
+}
+
+/* remove input I from the timer heap */
+static void remove_timer(struct input *i) {
+  size_t n = i->timer;
+  struct input *last;
+
+  i->timer = (size_t)-1;
+  if(n == --ntimers)
+    return;
+  /* the last timer fills the gap, and may belong above or below it */
+  last = timers[n] = timers[ntimers];
+  timer_up(n);
+  timer_down(last->timer);
+}
+
 struct input *ld_new_input(int fd, void *l) {
   struct input *i = xmalloc(sizeof *i);
   sigset_t ss;
 
   i->fd = fd;
   i->suspended.tv_sec = i->suspended.tv_usec = 0;
+  i->next_suspended = 0;
+  i->buffer = 0;
+  i->bytes = 0;
+  i->pending_on = 0;
+  i->next_pending = 0;
+  i->timer = (size_t)-1;
+  i->name = 0;
+  i->pid = 0;
+  i->tag = 0;
+  i->prefix = 0;
+  i->prefix_len = 0;
+  i->midline = i->buffer_midline = 0;
+  i->shm = 0;
+  i->hangup_fd = -1;
+  i->in_flight = 0;
+  i->stalled_on = 0;
+  i->next_stalled = 0;
+  i->deleted = 0;
   i->log = l;
   i->input_callback = ld_input_callback;
   i->daily_callback = ld_daily_callback;
   block(&ss);
-  if(i->fd != -1) {
-    FD_SET(i->fd, &fds);
-    if(maxinput != -1 && i->fd > maxinput)
-      maxinput = i->fd;
-  }
+  if(i->fd != -1)
+    nonblock(i->fd);
+  watch(i);
+  if(ev)
+    add_timer(i);
   i->next = ld_inputs;
   ld_inputs = i;
   unblock(&ss);
   return i;
 }
 
+struct input *ld_new_shm_input(struct shmring *r, int hangup_fd,
+                               struct logfile *l) {
+  struct input *i = ld_new_input(-1, l);
+  sigset_t ss;
+
+  block(&ss);
+  i->fd = r->data_fd;
+  i->shm = r;
+  i->hangup_fd = hangup_fd;
+  i->input_callback = ld_shm_callback;
+  nonblock(i->hangup_fd);
+  watch(i);
+  unblock(&ss);
+  return i;
+}
+
 void ld_delete_input(struct input *i) {
   struct input **ii;
   sigset_t ss;
+  struct timeval now;
 
   block(&ss);
+  /* don't lose anything it's read.  If that's up to a writer thread,
+   * finish() comes back here once it's done, rather than ld_loop
+   * waiting for it. */
+  if(i->pending_on && i->pending_on->batch) {
+    i->deleted = 1;
+    rewatch(i);
+    if(i->timer != (size_t)-1)
+      remove_timer(i);
+    unblock(&ss);
+    return;
+  }
+  if(i->pending_on) {
+    gettimeofday(&now, NULL);
+    flush(i->pending_on, now);
+  }
   for(ii = &ld_inputs; *ii && *ii != i; ii = &(*ii)->next)
     ;
   if(*ii)
     *ii = i->next;
-  if(i->fd != -1) {
-    FD_CLR(i->fd, &fds);
-    if(i->fd == maxinput)
-      maxinput = -1;
+  if(i->stalled_on) {
+    for(ii = &i->stalled_on->stalled; *ii != i; ii = &(*ii)->next_stalled)
+      ;
+    *ii = i->next_stalled;
   }
+  if(i->suspended.tv_sec)
+    unsuspend(i);
+  if(ev && i->fd != -1)
+    ev_remove(ev, i->fd);
+  if(ev && i->hangup_fd != -1)
+    ev_remove(ev, i->hangup_fd);
+  if(i->timer != (size_t)-1)
+    remove_timer(i);
   unblock(&ss);
-  if(i->fd != -1)
+  if(i->shm)
+    shmring_free(i->shm);
+  else if(i->fd != -1)
     close(i->fd);
+  if(i->hangup_fd != -1)
+    close(i->hangup_fd);
+  free(i->buffer);
+  free(i->name);
+  free(i->tag);
+  free(i->prefix);
   free(i);
 }
 
@@ -219,11 +1161,12 @@ void ld_suspend_input(struct input *i) {
     sigset_t ss;
 
     block(&ss);
-    FD_CLR(i->fd, &fds);
     gettimeofday(&i->suspended, NULL);
-    i->suspended.tv_sec += SUSPEND_PERIOD;
-    if(i->fd == maxinput)
-      maxinput = -1;
+    i->suspended.tv_sec += ld_retry;
+    rewatch(i);
+    i->next_suspended = 0;
+    *suspended_tail = i;
+    suspended_tail = &i->next_suspended;
     ++suspended;
     unblock(&ss);
   }
@@ -235,11 +1178,8 @@ void ld_resume_input(struct input *i) {
     struct timeval now;
 
     block(&ss);
-    i->suspended.tv_sec = i->suspended.tv_usec = 0;
-    FD_SET(i->fd, &fds);
-    if(maxinput != -1 && i->fd > maxinput)
-      maxinput = i->fd;
-    --suspended;
+    unsuspend(i);
+    rewatch(i);
     /* ld_loop calls back with signals blocked, so we do too */
     gettimeofday(&now, NULL);
     (*i->input_callback)(i, now);
@@ -247,11 +1187,205 @@ void ld_resume_input(struct input *i) {
   }
 }
 
+/* return the first time after NOW at which the expansion of L's
+ * pattern might differ from its expansion at NOW.  T is NOW broken
+ * down according to L's time zone. */
+static time_t next_change(const struct logfile *l, const struct tm *t,
+                          time_t now) {
+  const char *p;
+  struct tm next;
+  int unit = 86400; /* smallest unit of time in the pattern */
+
+  for(p = l->pattern; (p = strchr(p, '%'));) {
+    /* skip any flags, field width and E or O modifier */
+    ++p;
+    p += strspn(p, "_-0^#123456789");
+    if(*p == 'E' || *p == 'O')
+      ++p;
+    if(!*p)
+      break;
+    switch(*p++) {
+    case 's':
+    case 'S':
+    case 'T':
+    case 'r':
+    case 'c':
+    case 'X': /* seconds */ unit = 1; break;
+    case 'M':
+    case 'R': /* minutes */
+      if(unit > 60)
+        unit = 60;
+      break;
+    case 'H':
+    case 'I':
+    case 'k':
+    case 'l':
+    case 'p':
+    case 'P':
+    case 'z':
+    case 'Z': /* hours (time zones change on the hour) */
+      if(unit > 3600)
+        unit = 3600;
+      break;
+    default:
+      /* anything not known to last at least a day might change at
+       * any moment */
+      if(!strchr("aAbBCdDeFgGhjmntuUVwWxyY%", p[-1]))
+        unit = 1;
+      break;
+    }
+  }
+  switch(unit) {
+  case 1: return now + 1;
+  case 60: return now + 60 - t->tm_sec;
+  case 3600: return now + 3600 - t->tm_min * 60 - t->tm_sec;
+  }
+  /* days and anything longer change at midnight */
+  if(l->usegmt)
+    return now + 86400 - t->tm_hour * 3600 - t->tm_min * 60 - t->tm_sec;
+  /* local days aren't always 86400 seconds long */
+  next = *t;
+  ++next.tm_mday;
+  next.tm_hour = next.tm_min = next.tm_sec = 0;
+  next.tm_isdst = -1;
+  return mktime(&next);
+}
+
+/* append a record about L's file E to the index.  OP is 'a' for a new
+ * file, 'c' when it's been compressed and 'd' when it's gone.  The
+ * fields are separated by tabs, which is why files with tabs (or
+ * newlines) in their names aren't indexed. */
+static void journal(int op, const struct logfile *l,
+                    const struct ld_entry *e) {
+  const char *suffix = e->codec ? e->codec->suffix : "";
+  size_t size;
+  char *record;
+  int n;
+
+  if(index_fd == -1)
+    return;
+  size = strlen(suffix) + strlen(l->pattern) + strlen(e->path) + 32;
+  record = xmalloc(size);
+  n = snprintf(record, size, "%c\t%lld\t%s\t%s\t%s\n", op,
+               (long long)e->time, suffix, l->pattern, e->path);
+  if(writeall(index_fd, record, n) < 0)
+    errore("error writing to %s", ld_index);
+  free(record);
+}
+
+/* add PATH, compressed with CODEC (or 0), to the end of L's index
+ * entries, and return the new entry.  TIME is when it was created. */
+static struct ld_entry *add_entry(struct logfile *l, const char *path,
+                                  const struct ld_codec *codec, time_t time) {
+  struct ld_entry *e = xmalloc(sizeof *e);
+
+  e->next = 0;
+  e->path = xstrdup(path);
+  e->codec = codec;
+  e->time = time;
+  e->compressing = 0;
+  *l->entries_tail = e;
+  l->entries_tail = &e->next;
+  if(!l->uncompressed && !codec)
+    l->uncompressed = e;
+  return e;
+}
+
+/* remove E from L's index entries and free it */
+static void remove_entry(struct logfile *l, struct ld_entry *e) {
+  struct ld_entry **ee;
+
+  for(ee = &l->entries; *ee != e; ee = &(*ee)->next)
+    ;
+  if(!(*ee = e->next))
+    l->entries_tail = ee;
+  if(l->uncompressed == e)
+    l->uncompressed = e->next;
+  free(e->path);
+  free(e);
+}
+
+/* return L's index entry for PATH, or 0.  Entries are looked up when
+ * they're about to be compressed or deleted, so they're usually near
+ * the start. */
+static struct ld_entry *find_entry(struct logfile *l, const char *path) {
+  struct ld_entry *e;
+
+  for(e = l->entries; e && strcmp(e->path, path); e = e->next)
+    ;
+  return e;
+}
+
+/* record that L's file PATH was created at time NOW */
+static void index_add(struct logfile *l, const char *path,
+                      const struct ld_codec *codec, time_t now) {
+  if(index_fd == -1 || strpbrk(path, "\t\n") || strpbrk(l->pattern, "\t\n"))
+    return;
+  journal('a', l, add_entry(l, path, codec, now));
+}
+
+/* open segment L->segment of L->base, creating directories if
+ * necessary.  If the file is new it's added to the index as created at
+ * NOW.  Returns 0 on success and -1 on error. */
+static int open_segment(struct logfile *l, time_t now) {
+  char *plain, *newpath, segment[32] = "";
+  int flags = O_WRONLY | O_CREAT | O_APPEND, made_dirs = 0;
+  struct stat sb;
+
+  if(l->segment)
+    snprintf(segment, sizeof segment, ".%u", l->segment);
+  plain = xstrdupcat(l->base, segment);
+  newpath = l->stream ? xstrdupcat(plain, ".gz") : xstrdup(plain);
+  /* if there's an index, we need to know whether the file is new */
+  if(index_fd != -1)
+    flags |= O_EXCL;
+  while((l->fd = open(newpath, flags, 0666)) < 0) {
+    if(errno == EEXIST && (flags & O_EXCL))
+      flags &= ~O_EXCL;
+    else if(errno == ENOENT && !made_dirs) {
+      char *ptr;
+      /* this probably means the directory is missing, we attempt to
+       * create it */
+      ptr = newpath;
+      while(*ptr) {
+        if(*ptr == '/' && ptr != newpath) {
+          *ptr = 0;
+          mkdir(newpath, 0777);
+          *ptr = '/';
+        }
+        ++ptr;
+      }
+      /* try again after (possibly...) creating directories */
+      made_dirs = 1;
+    } else {
+      /* the name is cached, so an unopened file mustn't be recorded
+       * as open */
+      errore("error opening %s", newpath);
+      free(newpath);
+      free(plain);
+      return -1;
+    }
+  }
+  if(flags & O_EXCL)
+    index_add(l, plain, l->stream ? ld_find_codec("gzip") : 0, now);
+  free(plain);
+  l->size = fstat(l->fd, &sb) < 0 ? 0 : sb.st_size;
+  /* record what path we've opened */
+  l->path = newpath;
+  return 0;
+}
+
 int ld_open_logfile(struct logfile *l, struct timeval now) {
   char *newpath = 0;
   size_t size = 1024;
   struct tm *t;
 
+  settle(l);
+  /* if the file's open and its name can't have changed, there's
+   * nothing to do */
+  if(l->path && now.tv_sec >= l->valid_from && now.tv_sec < l->valid_until
+     && !(l->max_size && l->size >= l->max_size))
+    return 0;
   /* work out the filename we'll write to */
   t = (l->usegmt ? gmtime : localtime)(&now.tv_sec);
   /* keep expanding the buffer for the path until it's big enough */
@@ -265,44 +1399,47 @@ int ld_open_logfile(struct logfile *l, struct timeval now) {
     else
       break;
   }
-  /* if the currently open filename is wrong, close it */
-  if(l->path && strcmp(l->path, newpath))
+  /* if the currently open filename is wrong, close it; if it's full,
+   * close it and move on to the next segment */
+  if(l->path && strcmp(l->base, newpath))
+    ld_close_logfile(l);
+  else if(l->path && l->max_size && l->size >= l->max_size) {
     ld_close_logfile(l);
+    ++l->segment;
+  }
   /* if the is an open file it must now be the right one; so if there
    * is no file, open the newly chosen name. */
   if(!l->path) {
-    /* try to open the file */
-    if((l->fd = open(newpath, O_WRONLY | O_CREAT | O_APPEND, 0666)) < 0) {
-      if(l->fd == -1 && errno == ENOENT) {
-        char *ptr;
-        /* this probably means the directory is missing, we attempt to
-         * create it */
-        ptr = newpath;
-        while(*ptr) {
-          if(*ptr == '/' && ptr != newpath) {
-            *ptr = 0;
-            mkdir(newpath, 0777);
-            *ptr = '/';
-          }
-          ++ptr;
-        }
-        /* try again after (possibly...) creating directories */
-        if((l->fd = open(newpath, O_WRONLY | O_CREAT | O_APPEND, 0666)) < 0) {
-          errore("error opening %s", newpath);
-          free(newpath);
-          return -1;
-        }
-      }
+    /* a new name means starting from the first segment again */
+    if(!l->base || strcmp(l->base, newpath)) {
+      free(l->base);
+      l->base = xstrdup(newpath);
+      l->segment = 0;
+    }
+    /* skip segments that are already full, e.g. from a previous run */
+    while(open_segment(l, now.tv_sec) == 0 && l->max_size
+          && l->size >= l->max_size) {
+      ld_close_logfile(l);
+      ++l->segment;
+    }
+    if(!l->path) {
+      free(newpath);
+      return -1;
     }
-    /* record what path we've opened */
-    l->path = xstrdup(newpath);
   }
   free(newpath);
+  l->valid_from = now.tv_sec;
+  l->valid_until = next_change(l, t, now.tv_sec);
   return 0;
 }
 
 void ld_close_logfile(struct logfile *l) {
+  /* don't pull the file out from under a writer thread */
+  settle(l);
+  /* the open member belongs in this file */
+  finish_member(l);
   if(l->fd != -1) {
+    zabandon(l);
     close(l->fd);
     l->fd = -1;
     free(l->path);
@@ -311,182 +1448,337 @@ void ld_close_logfile(struct logfile *l) {
 }
 
 struct timeval ld_next_daily(struct timeval now) {
-  /* XXX the user might want midnight local time; we currently only
-   * implement midnight GMT.  Patches invited, probably from people
-   * who live outside GMT-land. */
   now.tv_sec += ld_day;
   now.tv_sec -= now.tv_sec % ld_day;
   now.tv_usec = 0;
   return now;
 }
 
-static void daily(struct timeval now, struct timeval *next_daily) {
-  struct input *i = ld_inputs;
+struct timeval ld_next_scheduled(const struct logfile *l, struct timeval now) {
+  struct tm t;
+  time_t next;
 
-  while(i) {
-    struct input *inext = i->next;
-
-    if(i->daily_callback)
-      (*i->daily_callback)(i, now);
-    i = inext;
+  if(l->schedule == LD_EVERY_DAY)
+    return ld_next_daily(now);
+  localtime_r(&now.tv_sec, &t);
+  switch(l->schedule) {
+  case LD_HOURLY:
+    ++t.tm_hour;
+    t.tm_min = 0;
+    break;
+  case LD_MIDNIGHT:
+    ++t.tm_mday;
+    t.tm_hour = t.tm_min = 0;
+    break;
+  case LD_AT:
+    /* today if it's still to come, otherwise tomorrow */
+    if(t.tm_hour * 60 + t.tm_min >= l->schedule_at)
+      ++t.tm_mday;
+    t.tm_hour = l->schedule_at / 60;
+    t.tm_min = l->schedule_at % 60;
+    break;
   }
-  *next_daily = ld_next_daily(now);
+  t.tm_sec = 0;
+  t.tm_isdst = -1;
+  next = mktime(&t);
+  /* clocks going back can make the same local time happen twice */
+  if(next <= now.tv_sec)
+    next = now.tv_sec + 1;
+  now.tv_sec = next;
+  now.tv_usec = 0;
+  return now;
+}
+
+int ld_parse_schedule(struct logfile *l, const char *s) {
+  unsigned hour, minute;
+  char c;
+
+  if(!strcmp(s, "day"))
+    l->schedule = LD_EVERY_DAY;
+  else if(!strcmp(s, "midnight"))
+    l->schedule = LD_MIDNIGHT;
+  else if(!strcmp(s, "hourly"))
+    l->schedule = LD_HOURLY;
+  else if(sscanf(s, "%2u:%2u%c", &hour, &minute, &c) == 2 && hour < 24
+          && minute < 60) {
+    l->schedule = LD_AT;
+    l->schedule_at = hour * 60 + minute;
+  } else
+    return -1;
+  return 0;
 }
 
 int ld_loop(void) {
   struct input *i;
-  struct timeval now, next_daily;
+  struct timeval now, deadline, tv;
   sigset_t ss;
+  int timeout, rc = 0;
 
+  /* callbacks run with signals blocked; they are only let through
+   * while waiting */
   block(&ss);
-  /* calculate fd set, which might not have been initialized
-   * sensibly */
-  FD_ZERO(&fds);
-  for(i = ld_inputs; i; i = i->next)
-    if(i->fd != -1)
-      FD_SET(i->fd, &fds);
-  unblock(&ss);
-  /* work out when to next do rotations, etc */
+  ev = ev_new();
+  for(i = ld_inputs; i; i = i->next) {
+    watch(i);
+    add_timer(i);
+  }
+  if(ld_index)
+    open_index();
+  start_writers();
+  start_compressors();
   gettimeofday(&now, NULL);
-  next_daily = ld_next_daily(now);
-  while(ld_inputs) {
-    fd_set rfds;
-    struct timeval tv;
-    int n;
-
-    gettimeofday(&now, NULL);
-    block(&ss);
-    /* see if we need to rotate yet */
-    if(tvcmp(&now, &next_daily) >= 0) {
-      daily(now, &next_daily);
+  /* finish compressing before returning, so that the caller can
+   * exit */
+  while(ld_inputs || compressions) {
+    /* do rotations, etc, that are due.  The next deadline is set
+     * first, since the callback might delete the input. */
+    if(ntimers && tvcmp(&timers[0]->due, &now) <= 0) {
+      while(ntimers && tvcmp(&(i = timers[0])->due, &now) <= 0) {
+        i->due = next_due(i, now);
+        timer_down(0);
+        (*i->daily_callback)(i, now);
+      }
       gettimeofday(&now, NULL);
     }
-    /* unsuspend inputs */
-    if(suspended) {
-      for(i = ld_inputs; i; i = i->next) {
-        if(i->suspended.tv_sec && tvcmp(&i->suspended, &now) <= 0) {
-          ld_resume_input(i);
-          if(!suspended)
-            break;
-        }
-      }
+    /* unsuspend inputs.  Resuming an input may suspend it again, but
+     * then it goes to the back of the queue. */
+    while(suspended_head && tvcmp(&suspended_head->suspended, &now) <= 0)
+      ld_resume_input(suspended_head);
+    flush_all();
+    expire_members(now, 0);
+    if(!ld_inputs && !compressions)
+      break;
+    /* wait until the next rotation, resumption or member deadline at
+     * the latest */
+    deadline.tv_sec = now.tv_sec + INT_MAX / 1000;
+    deadline.tv_usec = 0;
+    if(ntimers && tvcmp(&timers[0]->due, &deadline) < 0)
+      deadline = timers[0]->due;
+    if(suspended_head && tvcmp(&suspended_head->suspended, &deadline) < 0)
+      deadline = suspended_head->suspended;
+    if(members && members->member_started + ld_member_interval
+                      < deadline.tv_sec) {
+      deadline.tv_sec = members->member_started + ld_member_interval;
+      deadline.tv_usec = 0;
     }
-    if(maxinput == -1) {
-      /* recalculate maximum FD */
-      for(i = ld_inputs; i; i = i->next)
-        if(i->fd > maxinput)
-          maxinput = i->fd;
+    tv = tvsub(&deadline, &now);
+    if(tv.tv_sec < 0)
+      timeout = 0;
+    else if(tv.tv_sec >= INT_MAX / 1000)
+      timeout = INT_MAX;
+    else
+      timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+    if(ev_wait(ev, timeout, &ss) < 0 && errno != EINTR) {
+      errore("error waiting for input");
+      rc = -1; /* fatal error from epoll/poll */
+      break;
     }
+    /* everything ready has been read; write it out */
+    flush_all();
+    gettimeofday(&now, NULL);
+  }
+  stop_writers();
+  /* don't leave a truncated member at the end of any file */
+  expire_members(now, 1);
+  if(index_fd != -1) {
+    close(index_fd);
+    index_fd = -1;
+  }
+  while(ntimers)
+    remove_timer(timers[ntimers - 1]);
+  ev_delete(ev);
+  ev = 0;
+  unblock(&ss);
+  return rc;
+}
 
-    /* copy file descriptor set */
-    rfds = fds;
-    /* work out timeout */
-    tv = tvsub(&next_daily, &now);
-    if(tv.tv_sec < 0) {
-      tv.tv_sec = 0;
-      tv.tv_usec = 0;
+/* set up the prefix for lines read by input I at time NOW */
+static void build_prefix(struct input *i, struct timeval now) {
+  struct logfile *l = i->log;
+  struct tm t;
+  long usec;
+  int n;
+
+  if(!i->tag) {
+    size_t size = (i->name ? strlen(i->name) : 0) + 32;
+
+    i->tag = xmalloc(size);
+    n = 0;
+    if(i->name && (l->prefix & LD_PREFIX_NAME))
+      n += snprintf(i->tag + n, size - n, "%s", i->name);
+    if(i->pid && (l->prefix & LD_PREFIX_PID))
+      n += snprintf(i->tag + n, size - n, "[%lu]", (unsigned long)i->pid);
+    strcpy(i->tag + n, n ? ": " : "");
+    i->prefix = xmalloc(sizeof l->stamp + strlen(i->tag));
+  }
+  i->prefix_len = 0;
+  if(l->prefix & LD_PREFIX_TIME) {
+    /* the formatted time only changes once a second... */
+    if(now.tv_sec != l->stamp_sec || !l->stamp_len) {
+      (l->usegmt ? gmtime_r : localtime_r)(&now.tv_sec, &t);
+      l->stamp_frac = strftime(l->stamp, sizeof l->stamp, "%Y-%m-%dT%H:%M:%S.",
+                               &t);
+      l->stamp_len = l->stamp_frac + 6;
+      l->stamp_len += strftime(l->stamp + l->stamp_len,
+                               sizeof l->stamp - l->stamp_len,
+                               l->usegmt ? "Z " : "%z ", &t);
+      l->stamp_sec = now.tv_sec;
     }
-    if(suspended && tv.tv_sec > SELECT_RESOLUTION)
-      tv.tv_sec = SELECT_RESOLUTION;
-    unblock(&ss);
-    /* wait for something to happen */
-    n = select(maxinput + 1, &rfds, 0, 0, &tv);
-    if(n < 0) {
-      if(errno == EINTR)
-        continue;
-      errore("select");
-      return -1; /* fatal error from select */
-    }
-    if(n) {
-      block(&ss);
-      /* see which inputs tripped */
-      i = ld_inputs;
-      while(i) {
-        struct input *inext = i->next;
-        if(i->fd != -1 && FD_ISSET(i->fd, &rfds)) {
-          (*i->input_callback)(i, now);
-          if(--n == 0)
-            break;
-        }
-        i = inext;
-      }
-      unblock(&ss);
+    memcpy(i->prefix, l->stamp, l->stamp_len);
+    /* ...otherwise only the microseconds need filling in */
+    for(n = 6, usec = now.tv_usec; n-- > 0; usec /= 10)
+      i->prefix[l->stamp_frac + n] = '0' + usec % 10;
+    i->prefix_len = l->stamp_len;
+  }
+  strcpy(i->prefix + i->prefix_len, i->tag);
+  i->prefix_len += strlen(i->tag);
+}
+
+/* return the number of lines that start in the BYTES just read into
+ * the end of input I's buffer, and update its midline */
+static size_t line_starts(struct input *i, size_t bytes) {
+  char *p = i->buffer + i->bytes - bytes, *end = i->buffer + i->bytes;
+  size_t n = !i->midline;
+
+  while((p = memchr(p, '\n', end - p)) && ++p < end)
+    ++n;
+  i->midline = end[-1] != '\n';
+  return n;
+}
+
+/* queue input I to be written with anything else for its logfile.  If
+ * there's a backlog, queue it even if there's nothing new, so that
+ * another attempt is made to write the backlog (and if it fails, the
+ * input will be suspended rather than repeatedly called back). */
+static void enqueue(struct input *i) {
+  struct logfile *l = i->log;
+
+  if((i->bytes || l->backlog_bytes) && !i->pending_on) {
+    if(!l->pending) {
+      l->next_dirty = dirty;
+      dirty = l;
     }
+    i->pending_on = l;
+    *l->pending_tail = i;
+    l->pending_tail = &i->next_pending;
   }
-  return 0;
 }
 
 void ld_input_callback(struct input *i, struct timeval now) {
-  char buffer[4096];
-  int bytes;
   struct logfile *l = i->log;
-  int written;
+  ssize_t bytes = 1;
+  size_t room;
 
-  /* flush buffered data */
-  while(l->bufsize) {
-    bytes = write(l->fd, l->buffer, l->bufsize);
-    if(bytes < 0) {
-      errore("error writing to %s", l->path);
-      close(l->fd);
-      l->fd = -1;
-      free(l->path);
-      l->path = 0;
-      ld_suspend_input(i);
-      return;
-    }
-    memmove(l->buffer, l->buffer + bytes, l->bufsize -= bytes);
-    /* exercise for reader: more efficient handling of buffered
-     * data */
+  if(!i->buffer)
+    i->buffer = xmalloc(ld_bufsize);
+  /* each batch of data read gets its own prefix */
+  if(!i->bytes) {
+    if(l->prefix)
+      build_prefix(i, now);
+    else
+      i->prefix_len = 0;
+    i->buffer_midline = i->midline;
   }
-  /* free up the buffer if it has emptied */
-  if(l->buffer && !l->bufsize) {
-    free(l->buffer);
-    l->buffer = 0;
+  /* read until there's no more, or no more room */
+  for(;;) {
+    room = ld_bufsize - i->bytes;
+    /* if nothing may be dropped, don't read more than would fit in the
+     * backlog if it all failed to be written, including a prefix for
+     * every byte in the worst case */
+    if(l->overflow == LD_BLOCK) {
+      size_t left = l->backlog_max - l->backlog_bytes - l->queued;
+
+      if(i->prefix_len)
+        left = left > i->prefix_len
+                   ? (left - i->prefix_len) / (i->prefix_len + 1)
+                   : 0;
+      if(room > left)
+        room = left;
+    }
+    if(!room) {
+      /* the fd is still readable, so don't come back until there's
+       * room */
+      stall(i);
+      break;
+    }
+    if((bytes = read(i->fd, i->buffer + i->bytes, room)) <= 0)
+      break;
+    i->bytes += bytes;
+    l->queued += bytes;
+    if(i->prefix_len)
+      l->queued += line_starts(i, bytes) * i->prefix_len;
   }
-  /* read some data */
-  bytes = read(i->fd, buffer, sizeof buffer);
+  enqueue(i);
   if(bytes < 0) {
     /* we check EAGAIN, as sometimes we are called speculatively
-     * rather than from the select loop */
+     * rather than from the event loop */
     if(errno == EINTR || errno == EAGAIN)
-      return;
-    errore("error reading input stream");
-    ld_delete_input(i);
-    return;
+      bytes = 1;
+    else
+      errore("error reading input stream");
   }
-  if(bytes == 0) {
-    /* end of file */
+  if(bytes <= 0) {
+    /* end of file or error; ld_delete_input writes out what we've
+     * got */
     ld_delete_input(i);
     return;
   }
-  /* open the logfile */
-  if(ld_open_logfile(l, now)) {
-    ld_suspend_input(i);
-    return;
+  if(!ev)
+    flush(l, now);
+}
+
+void ld_shm_callback(struct input *i, struct timeval now) {
+  struct logfile *l = i->log;
+  size_t available, room;
+  ssize_t bytes;
+  int eof = 0;
+  char c;
+
+  /* the producer holds the write end of the hangup pipe, so it only
+   * becomes readable when the producer has finished.  Then the pipe
+   * is closed, and the ring drained over as many calls as it takes. */
+  shmring_signal(i->shm, 0);
+  if(i->hangup_fd == -1)
+    eof = 1;
+  else if((bytes = read(i->hangup_fd, &c, 1)) == 0)
+    eof = 1;
+  else if(bytes < 0 && errno != EINTR && errno != EAGAIN) {
+    errore("error reading input stream");
+    eof = 1;
+  }
+  if(eof && i->hangup_fd != -1) {
+    if(ev)
+      ev_remove(ev, i->hangup_fd);
+    close(i->hangup_fd);
+    i->hangup_fd = -1;
   }
-  /* output the data */
-  written = 0;
-  while(written < bytes) {
-    int n = write(l->fd, buffer + written, bytes - written);
+  /* take what's in the ring until it's empty, or we must stop */
+  for(;;) {
+    room = available = shmring_available(i->shm) - i->bytes;
+    if(l->overflow == LD_BLOCK) {
+      size_t left = l->backlog_max - l->backlog_bytes - l->queued;
 
-    if(n < 0) {
-      if(errno == EINTR)
-        continue;
-      errore("error writing to %s", l->path);
+      if(room > left)
+        room = left;
+    }
+    i->bytes += room;
+    l->queued += room;
+    if(room < available) {
+      /* come back for the rest once this lot has been written */
+      shmring_signal(i->shm, 1);
+      stall(i);
       break;
     }
-    written += n;
+    if(eof || shmring_idle(i->shm, i->bytes))
+      break;
   }
-  size_t unwritten = bytes - written;
-  if(unwritten > 0) {
-    /* buffer any remaining data */
-    l->buffer = xrealloc(l->buffer, l->bufsize + unwritten);
-    memcpy(l->buffer + l->bufsize, buffer + written, unwritten);
-    l->bufsize += unwritten;
-    /* close the logfile and come back to it in a while */
-    ld_close_logfile(l);
-    ld_suspend_input(i);
+  enqueue(i);
+  if(eof && room == available) {
+    ld_delete_input(i);
+    return;
   }
+  if(!ev)
+    flush(l, now);
 }
 
 void ld_syslog_callback(struct input *i,
@@ -502,7 +1794,7 @@ void ld_syslog_callback(struct input *i,
   bytes = read(i->fd, l->buffer, l->bufsize);
   if(bytes < 0) {
     /* we check EAGAIN, as sometimes we are called speculatively
-     * rather than from the select loop */
+     * rather than from the event loop */
     if(errno == EINTR || errno == EAGAIN)
       return;
     errore("error reading input stream");
@@ -526,6 +1818,482 @@ void ld_syslog_callback(struct input *i,
   }
 }
 
+const struct ld_codec *ld_find_codec(const char *name) {
+  const struct ld_codec *c;
+
+  for(c = ld_codecs; c->name; ++c)
+    if(!strcmp(c->name, name))
+      return c;
+  return 0;
+}
+
+/* make sure L's index entry E is looked at again by index_daily,
+ * since an attempt to compress it failed */
+static void retry_compression(struct logfile *l, struct ld_entry *e) {
+  struct ld_entry *f;
+
+  for(f = l->entries; f != e; f = f->next)
+    if(f == l->uncompressed)
+      return; /* it will be reached anyway */
+  l->uncompressed = e;
+}
+
+/* called when a compressor has exited */
+static void compressed(struct evloop __attribute__((unused)) * e, int fd,
+                       unsigned __attribute__((unused)) events, void *u) {
+  struct compression *c = u, **cc;
+  char buffer[64];
+  int status;
+  pid_t r;
+
+  /* nothing is written to the pipe, so this only returns 0 when the
+   * compressor has exited */
+  if(read(fd, buffer, sizeof buffer) != 0)
+    return;
+  ev_remove(ev, fd);
+  close(fd);
+  do
+    r = waitpid(c->pid, &status, 0);
+  while(r == -1 && errno == EINTR);
+  if(r == -1)
+    errore("error waiting for %s", ld_codec->name);
+  else if(status)
+    error("%s %s: %s", ld_codec->name, c->path, wstat(status));
+  if(c->entry) {
+    c->entry->compressing = 0;
+    if(r != -1 && !status) {
+      c->entry->codec = ld_codec;
+      journal('c', c->log, c->entry);
+    } else
+      retry_compression(c->log, c->entry);
+  }
+  for(cc = &compressions; *cc != c; cc = &(*cc)->next)
+    ;
+  *cc = c->next;
+  free(c->path);
+  free(c);
+  --compressing;
+  start_compressors();
+}
+
+/* start as many queued compressions as are allowed */
+static void start_compressors(void) {
+  struct compression *c;
+  sigset_t none;
+  char level[16];
+  const char *args[7];
+  int p[2], n;
+
+  for(c = compressions; c && ev && compressing < ld_compressors; c = c->next) {
+    if(c->pid != -1)
+      continue;
+    if(pipe(p) < 0) {
+      errore("error calling pipe");
+      return;
+    }
+    switch(c->pid = fork()) {
+    case 0:
+      /* the write end of the pipe is inherited by the compressor, so
+       * that it is closed when the compressor exits */
+      close(p[0]);
+      sigemptyset(&none);
+      sigprocmask(SIG_SETMASK, &none, 0);
+      n = 0;
+      args[n++] = ld_codec->name;
+      if(ld_level) {
+        snprintf(level, sizeof level, "-%d", ld_level);
+        args[n++] = level;
+      }
+      args[n++] = "-f";
+      if(ld_codec->remove)
+        args[n++] = ld_codec->remove;
+      args[n++] = "--";
+      args[n++] = c->path;
+      args[n] = 0;
+      execvp(args[0], (char **)args);
+      _exit(-1);
+    case -1:
+      errore("fork");
+      close(p[0]);
+      close(p[1]);
+      return;
+    }
+    close(p[1]);
+    c->fd = p[0];
+    cloexec(c->fd);
+    nonblock(c->fd);
+    ev_add(ev, c->fd, EV_READ, compressed, c);
+    ++compressing;
+  }
+}
+
+/* queue PATH to be compressed, unless it already is.  If it's in the
+ * index, L and E are its logfile and index entry, otherwise 0. */
+static void queue_compression(const char *path, struct logfile *l,
+                              struct ld_entry *e) {
+  struct compression *c, **cc;
+
+  for(cc = &compressions; *cc; cc = &(*cc)->next)
+    if(!strcmp((*cc)->path, path))
+      return;
+  c = xmalloc(sizeof *c);
+  c->next = 0;
+  c->path = xstrdup(path);
+  c->pid = -1;
+  c->fd = -1;
+  c->log = l;
+  c->entry = e;
+  if(e)
+    e->compressing = 1;
+  *cc = c;
+  start_compressors();
+}
+
+/* return true if PATH is queued for compression, or is the output of
+ * a compression that hasn't finished */
+static int compressing_path(const char *path) {
+  struct compression *c;
+  size_t len;
+
+  for(c = compressions; c; c = c->next) {
+    len = strlen(c->path);
+    if(!strncmp(path, c->path, len)
+       && (!path[len] || !strcmp(path + len, ld_codec->suffix)))
+      return 1;
+  }
+  return 0;
+}
+
+/* return the codec whose suffix PATH has, or 0 if it hasn't got one */
+static const struct ld_codec *is_compressed(const char *path) {
+  const struct ld_codec *c;
+  size_t len = strlen(path), slen;
+
+  for(c = ld_codecs; c->name; ++c)
+    if((slen = strlen(c->suffix)) <= len
+       && !strcmp(path + len - slen, c->suffix))
+      return c;
+  return 0;
+}
+
+/* find the files matching glob pattern PATTERN, and the segments
+ * after the first.  If SUFFIXES is set, include files compressed by
+ * any codec.  Returns 0 on success or a glob() error code. */
+static int glob_logs(const char *pattern, int suffixes, glob_t *g) {
+  const struct ld_codec *c;
+  char *cpattern;
+  int rc, flags = GLOB_NOSORT;
+
+  /* start with the first segment */
+  switch(rc = glob(pattern, flags, 0, g)) {
+  case 0:
+  case GLOB_NOMATCH: break;
+  default: return rc;
+  }
+  flags |= GLOB_APPEND;
+  /* later segments, compressed or not */
+  cpattern = xstrdupcat(pattern, ".[0-9]*");
+  rc = glob(cpattern, flags, 0, g);
+  free(cpattern);
+  switch(rc) {
+  case 0:
+  case GLOB_NOMATCH: break;
+  default: return rc;
+  }
+  /* compressed first segments */
+  for(c = ld_codecs; suffixes && c->name; ++c) {
+    cpattern = xstrdupcat(pattern, c->suffix);
+    rc = glob(cpattern, flags, 0, g);
+    free(cpattern);
+    switch(rc) {
+    case 0:
+    case GLOB_NOMATCH: break;
+    default: return rc;
+    }
+  }
+  return 0;
+}
+
+/* remove the log file PATH, and any directories containing it that
+ * were created for it.  PATTERN is the glob pattern the log file
+ * names match.  *DEFAULT_MODE caches the mode directories are created
+ * with, or is (mode_t)-1 if that hasn't been worked out yet. */
+static void remove_log(const char *pattern, char *path,
+                       mode_t *default_mode) {
+  struct stat sb;
+  int m;
+
+  if(unlink(path) < 0)
+    errore("removing %s", path);
+  /* We want to unlink containing directories, but rmdir'ing all
+   * the way down to the root seems like a bad idea.  There are
+   * a number of safeguards for this:
+   *
+   * Firstly we don't remove any subdirectory that exactly
+   * matches the prefix of the pattern.  So if the original
+   * pattern was /var/log/%Y/%m/%d/foo.log then we will remove
+   * everything below /var/log, but not /var/log itself (even if
+   * we have permission).
+   *
+   * Secondly we only remove genuine directories - once we hit a
+   * symlink, we stop dead.  If the user introduces symlinks in
+   * the the middle of the path, it is up to them to clear up
+   * the results.
+   *
+   * Thirdly we only remove directories that have the same
+   * permissions as they would get if we re-created them.
+   */
+  m = strlen(path);
+  while(m > 0) {
+    if(path[m] == '/') {
+      path[m] = 0;
+      /* lexical checks */
+      if(!strncmp(path, pattern, m))
+        break;
+      /* make sure we know what mode we create files with */
+      if(*default_mode == (mode_t)-1) {
+        mode_t u;
+        sigset_t ss;
+
+        block(&ss);
+        /* can't get the umask without changing it, argh */
+        u = umask(0777);
+        umask(u);
+        unblock(&ss);
+        *default_mode = 0777 ^ u;
+      }
+      /* checks based on the file system */
+      if(lstat(path, &sb) < 0 || !S_ISDIR(sb.st_mode)
+         || (sb.st_mode & 0777) != *default_mode
+         || sb.st_uid != geteuid() || sb.st_gid != getegid())
+        break;
+      /* attempt the removal */
+      if(rmdir(path) < 0)
+        break;
+    }
+    --m;
+  }
+}
+
+/* return the logfile with pattern PATTERN, creating it if necessary.
+ * Index entries for patterns that aren't in use are kept in logfiles
+ * that no input refers to, so that they aren't lost. */
+static struct logfile *find_logfile(const char *pattern) {
+  struct logfile *l;
+
+  for(l = ld_logfiles; l; l = l->next)
+    if(!strcmp(l->pattern, pattern))
+      return l;
+  return ld_new_logfile(pattern);
+}
+
+/* return the codec with suffix SUFFIX, or 0 if there isn't one */
+static const struct ld_codec *find_suffix(const char *suffix) {
+  const struct ld_codec *c;
+
+  for(c = ld_codecs; c->name; ++c)
+    if(!strcmp(c->suffix, suffix))
+      return c;
+  return 0;
+}
+
+/* read the index */
+static void read_index(void) {
+  FILE *fp;
+  char *line, *f[5], *p;
+  size_t len;
+  struct logfile *l;
+  struct ld_entry *e;
+  int n;
+
+  if(!(fp = fopen(ld_index, "r"))) {
+    if(errno != ENOENT)
+      fatale("error opening %s", ld_index);
+    return;
+  }
+  for(; (line = get_line(fp)); free(line)) {
+    /* a partial record means we crashed while writing it */
+    if(!(len = strlen(line)) || line[len - 1] != '\n') {
+      free(line);
+      break;
+    }
+    line[len - 1] = 0;
+    /* split into op, time, suffix, pattern and path */
+    f[0] = line;
+    for(n = 0; n < 4 && (p = strchr(f[n], '\t')); ++n) {
+      *p++ = 0;
+      f[n + 1] = p;
+    }
+    if(n < 4 || strlen(f[0]) != 1) {
+      error("%s: malformed record", ld_index);
+      continue;
+    }
+    l = find_logfile(f[3]);
+    switch(f[0][0]) {
+    case 'a':
+      add_entry(l, f[4], find_suffix(f[2]), (time_t)strtoll(f[1], 0, 10));
+      break;
+    case 'c':
+      if((e = find_entry(l, f[4])))
+        e->codec = find_suffix(f[2]);
+      break;
+    case 'd':
+      if((e = find_entry(l, f[4])))
+        remove_entry(l, e);
+      break;
+    default: error("%s: unknown record type '%s'", ld_index, f[0]); break;
+    }
+  }
+  if(ferror(fp))
+    fatale("error reading %s", ld_index);
+  fclose(fp);
+  /* compressions may have been recorded in any order */
+  for(l = ld_logfiles; l; l = l->next) {
+    for(e = l->entries; e && e->codec; e = e->next)
+      ;
+    l->uncompressed = e;
+  }
+}
+
+/* rewrite the index with just one record per file, and leave it open
+ * for appending */
+static void write_index(void) {
+  char *tmp = xstrdupcat(ld_index, ".new");
+  struct logfile *l;
+  struct ld_entry *e;
+
+  if(index_fd != -1)
+    close(index_fd);
+  if((index_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666)) < 0)
+    fatale("error opening %s", tmp);
+  cloexec(index_fd);
+  for(l = ld_logfiles; l; l = l->next)
+    for(e = l->entries; e; e = e->next)
+      journal('a', l, e);
+  if(fsync(index_fd) < 0)
+    fatale("error writing to %s", tmp);
+  if(rename(tmp, ld_index) < 0)
+    fatale("error renaming %s", tmp);
+  free(tmp);
+}
+
+/* a file found by rescan() */
+struct found {
+  time_t mtime; /* its modification time */
+  char *path;   /* its path */
+};
+
+/* compare two found files by modification time, then path */
+static int compare_found(const void *a, const void *b) {
+  const struct found *fa = a, *fb = b;
+
+  if(fa->mtime != fb->mtime)
+    return fa->mtime < fb->mtime ? -1 : 1;
+  return strcmp(fa->path, fb->path);
+}
+
+/* replace L's index entries with the files that are actually there, in
+ * order of modification time */
+static void rescan(struct logfile *l) {
+  char *pattern;
+  glob_t g;
+  size_t n, m = 0;
+  struct found *found;
+  struct stat sb;
+  const struct ld_codec *c;
+
+  if(!(pattern = ld_globtime(l->pattern))) {
+    error("cannot parse time pattern %s", l->pattern);
+    return;
+  }
+  switch(glob_logs(pattern, 1, &g)) {
+  case 0:
+  case GLOB_NOMATCH: break;
+  default:
+    error("error searching for %s", pattern);
+    globfree(&g);
+    free(pattern);
+    return;
+  }
+  while(l->entries)
+    remove_entry(l, l->entries);
+  found = xmalloc((g.gl_pathc + 1) * sizeof *found);
+  for(n = 0; n < g.gl_pathc; ++n)
+    if(lstat(g.gl_pathv[n], &sb) == 0 && S_ISREG(sb.st_mode)) {
+      found[m].mtime = sb.st_mtime;
+      found[m++].path = g.gl_pathv[n];
+    }
+  qsort(found, m, sizeof *found, compare_found);
+  for(n = 0; n < m; ++n) {
+    char *path = found[n].path;
+
+    /* the glob patterns can overlap */
+    if(n > 0 && !strcmp(path, found[n - 1].path))
+      continue;
+    c = is_compressed(path);
+    path = xmemdup(path, strlen(path) - (c ? strlen(c->suffix) : 0));
+    if(!strpbrk(path, "\t\n"))
+      add_entry(l, path, c, found[n].mtime);
+    free(path);
+  }
+  free(found);
+  globfree(&g);
+  free(pattern);
+}
+
+/* read the index, rebuilding it if ld_rescan is set, and rewrite it
+ * without the records that no longer matter */
+static void open_index(void) {
+  struct logfile *l;
+
+  read_index();
+  if(ld_rescan)
+    for(l = ld_logfiles; l; l = l->next)
+      rescan(l);
+  write_index();
+}
+
+/* delete and compress L's files as ld_daily_callback would, but using
+ * the index to find them.  PATTERN is the glob version of L's
+ * pattern. */
+static void index_daily(struct logfile *l, struct timeval now,
+                        const char *pattern) {
+  struct ld_entry *e;
+  struct stat sb;
+  char *path;
+  mode_t default_mode = (mode_t)-1;
+
+  /* entries are in (roughly) the order they expire, so stop at the
+   * first that can't have expired yet */
+  while(l->rotate && (e = l->entries) && !e->compressing
+        && e->time < now.tv_sec - l->rotate * ld_day) {
+    path = xstrdupcat(e->path, e->codec ? e->codec->suffix : "");
+    if(lstat(path, &sb) == 0 && S_ISREG(sb.st_mode)
+       && sb.st_mtime >= now.tv_sec - l->rotate * ld_day) {
+      /* still in use; look at it again when it might have expired */
+      journal('d', l, e);
+      journal('a', l, add_entry(l, e->path, e->codec, sb.st_mtime));
+    } else {
+      /* too old, or already gone */
+      if(lstat(path, &sb) == 0 && S_ISREG(sb.st_mode))
+        remove_log(pattern, path, &default_mode);
+      journal('d', l, e);
+    }
+    remove_entry(l, e);
+    free(path);
+  }
+  while(l->compress && (e = l->uncompressed)) {
+    if(!e->codec && !e->compressing && lstat(e->path, &sb) == 0
+       && S_ISREG(sb.st_mode)) {
+      /* better not compress a file we might re-open soon */
+      if(sb.st_mtime >= now.tv_sec - ld_day)
+        break;
+      queue_compression(e->path, l, e);
+    }
+    l->uncompressed = e->next;
+  }
+}
+
 void ld_daily_callback(struct input *i, struct timeval now) {
   struct logfile *l = i->log;
   char *pattern;
@@ -543,26 +2311,20 @@ void ld_daily_callback(struct input *i, struct timeval now) {
   pattern = ld_globtime(l->pattern);
   if(!pattern)
     fatal("cannot parse time pattern %s", l->pattern);
+  if(index_fd != -1) {
+    index_daily(l, now, pattern);
+    free(pattern);
+    return;
+  }
   if(l->rotate) {
-    /* get a list of all files */
-    switch(glob(pattern, GLOB_NOSORT, 0, &g)) {
+    /* get a list of all files, including compressed ones whatever
+     * they were compressed with */
+    switch(glob_logs(pattern, l->compress || l->stream, &g)) {
     case 0:
     case GLOB_NOMATCH: break;
     case GLOB_NOSPACE: goto nospace;
     case GLOB_ABORTED: goto readerror;
     }
-    if(l->compress) {
-      /* include compressed files */
-      char *cpattern = xstrdupcat(pattern, ".gz");
-
-      switch(glob(cpattern, GLOB_NOSORT | GLOB_APPEND, 0, &g)) {
-      case 0:
-      case GLOB_NOMATCH: break;
-      case GLOB_NOSPACE: free(cpattern); goto nospace;
-      case GLOB_ABORTED: free(cpattern); goto readerror;
-      }
-      free(cpattern);
-    }
     /* now find any too-old files */
     for(n = 0; n < g.gl_pathc; ++n) {
       struct stat sb;
@@ -570,67 +2332,17 @@ void ld_daily_callback(struct input *i, struct timeval now) {
 
       if(lstat(path, &sb) < 0)
         continue;
-      /* only care about regular files */
-      if(S_ISREG(sb.st_mode) && sb.st_mtime < now.tv_sec - l->rotate * ld_day) {
-        int m;
-
-        if(unlink(path) < 0)
-          errore("removing %s", path);
-        /* We want to unlink containing directories, but rmdir'ing all
-         * the way down to the root seems like a bad idea.  There are
-         * a number of safeguards for this:
-         *
-         * Firstly we don't remove any subdirectory that exactly
-         * matches the prefix of the pattern.  So if the original
-         * pattern was /var/log/%Y/%m/%d/foo.log then we will remove
-         * everything below /var/log, but not /var/log itself (even if
-         * we have permission).
-         *
-         * Secondly we only remove genuine directories - once we hit a
-         * symlink, we stop dead.  If the user introduces symlinks in
-         * the the middle of the path, it is up to them to clear up
-         * the results.
-         *
-         * Thirdly we only remove directories that have the same
-         * permissions as they would get if we re-created them.
-         */
-        m = strlen(path);
-        while(m > 0) {
-          if(path[m] == '/') {
-            path[m] = 0;
-            /* lexical checks */
-            if(!strncmp(path, pattern, m))
-              break;
-            /* make sure we know what mode we create files with */
-            if(default_mode == (mode_t)-1) {
-              mode_t u;
-              sigset_t ss;
-
-              block(&ss);
-              /* can't get the umask without changing it, argh */
-              u = umask(0777);
-              umask(u);
-              unblock(&ss);
-              default_mode = 0777 ^ u;
-            }
-            /* checks based on the file system */
-            if(lstat(path, &sb) < 0 || !S_ISDIR(sb.st_mode)
-               || (sb.st_mode & 0777) != default_mode || sb.st_uid != geteuid()
-               || sb.st_gid != getegid())
-              break;
-            /* attempt the removal */
-            if(rmdir(path) < 0)
-              break;
-          }
-          --m;
-        }
-      }
+      /* only care about regular files, and leave the compressor's
+       * alone until it has finished with them */
+      if(S_ISREG(sb.st_mode) && sb.st_mtime < now.tv_sec - l->rotate * ld_day
+         && !compressing_path(path))
+        remove_log(pattern, path, &default_mode);
     }
     globfree(&g);
   }
   if(l->compress) {
     /* get a list of all uncompressed files */
-    switch(glob(pattern, GLOB_NOSORT, 0, &g)) {
+    switch(glob_logs(pattern, 0, &g)) {
     case 0:
     case GLOB_NOMATCH: break;
     case GLOB_NOSPACE: goto nospace;
@@ -639,34 +2351,16 @@ void ld_daily_callback(struct input *i, struct timeval now) {
     for(n = 0; n < g.gl_pathc; ++n) {
       struct stat sb;
       char *path = g.gl_pathv[n];
-      size_t l = strlen(path);
 
       /* skip already-compressed files */
-      if(l >= 3 && !strcmp(path + l - 3, ".gz"))
+      if(is_compressed(path))
         continue;
       if(lstat(path, &sb) < 0)
         continue;
       /* only care about regular files more than a day old,
        * i.e. better not comress a file we might re-open soon */
-      if(S_ISREG(sb.st_mode) && sb.st_mtime < now.tv_sec - ld_day) {
-        pid_t pid, r;
-        int status;
-
-        /* try to compress the file */
-        switch(pid = fork()) {
-        case 0:
-          /* XXX should support more than just gzip */
-          execlp("gzip", "gzip", "-9f", path, (char *)0);
-          _exit(-1);
-        case -1: errore("fork"); break;
-        default: do { r = waitpid(pid, &status, 0);
-          } while(r == -1 && errno == EINTR);
-          if(r == -1)
-            errore("error waiting for gzip");
-          else if(status)
-            error("wait status from gzip -9f %s: %#x", path, (unsigned)status);
-        }
-      }
+      if(S_ISREG(sb.st_mode) && sb.st_mtime < now.tv_sec - ld_day)
+        queue_compression(path, 0, 0);
     }
     globfree(&g);
   }
@@ -700,6 +2394,9 @@ char *ld_globtime(const char *pattern) {
       s[n++] = '\\';
       break;
     case '%':
+      /* the E and O modifiers only change the representation */
+      if(*pattern == 'E' || *pattern == 'O')
+        ++pattern;
       c = *pattern++;
       switch(c) {
       case '%': /* literal % */ break;
@@ -736,6 +2433,7 @@ char *ld_globtime(const char *pattern) {
       case 'W': /* week number */
       case 'y':
       case 'Y': /* year */
+      case 'z':
       case 'Z': /* timezone */ c = '*'; break;
       default: free(s); return 0;
       }
@@ -19,18 +19,79 @@
 #ifndef LOGDAEMON_H
 #define LOGDAEMON_H
 
+#include "ring.h"
+#include "shmring.h"
+
+/* what to do when a logfile's backlog is full */
+#define LD_BLOCK 0       /* stop reading its inputs until there's room */
+#define LD_DROP_OLDEST 1 /* discard the oldest data */
+#define LD_DROP_NEWEST 2 /* discard the newest data */
+
+/* when a logfile's daily callbacks run */
+#define LD_EVERY_DAY 0 /* every ld_day seconds (midnight GMT by default) */
+#define LD_MIDNIGHT 1  /* local midnight */
+#define LD_HOURLY 2    /* on the hour */
+#define LD_AT 3        /* at a local time of day */
+
+/* what to put at the start of each line */
+#define LD_PREFIX_TIME 1 /* when it was read, to the microsecond */
+#define LD_PREFIX_NAME 2 /* the input's name */
+#define LD_PREFIX_PID 4  /* the input's pid */
+
 struct logfile {
-  struct logfile *next; /* next logfile */
-  int refs;             /* reference count */
-  char *pattern;        /* filename pattern */
-  char *path;           /* open path (or 0) */
-  int fd;               /* output file descriptor or -1 */
-  long date;            /* date of open version */
-  int rotate;           /* number of days to keep */
-  int compress;         /* whether to compress old copies */
-  int usegmt;           /* use GMT in names */
-  char *buffer;         /* buffer for saved data */
-  size_t bufsize;       /* buffer size */
+  struct logfile *next;           /* next logfile */
+  int refs;                       /* reference count */
+  char *pattern;                  /* filename pattern */
+  char *path;                     /* open path (or 0) */
+  char *base;                     /* expansion of pattern for path (or 0) */
+  unsigned segment;               /* segment number of path */
+  off_t size;                     /* size of open file */
+  off_t max_size;                 /* size to start a new segment at, or 0 */
+  time_t valid_from;              /* path is right from this time... */
+  time_t valid_until;             /* ...until just before this one */
+  int fd;                         /* output file descriptor or -1 */
+  long date;                      /* date of open version */
+  int rotate;                     /* number of days to keep */
+  int compress;                   /* whether to compress old copies */
+  int usegmt;                     /* use GMT in names */
+  struct ring backlog;            /* data that couldn't be written yet */
+  size_t backlog_start;           /* offset of oldest byte in backlog */
+  size_t backlog_bytes;           /* bytes in backlog */
+  size_t backlog_max;             /* most bytes to keep in backlog */
+  int overflow;                   /* LD_BLOCK, LD_DROP_OLDEST or
+                                   * LD_DROP_NEWEST */
+  unsigned long long dropped;     /* bytes dropped due to overflow */
+  size_t queued;                  /* bytes in pending inputs */
+  struct input *pending;          /* inputs with data to write */
+  struct input **pending_tail;    /* end of pending list */
+  struct logfile *next_dirty;     /* next logfile with data to write */
+  int stream;                     /* true to write gzip members directly */
+  void *member;                   /* z_stream for the open member, or 0 */
+  time_t member_started;          /* when it was opened */
+  size_t member_bytes;            /* uncompressed bytes in it */
+  char *zbuf;                     /* compressed data not yet written */
+  size_t zbytes, zsize;           /* bytes in zbuf, size of zbuf */
+  int zstarted;                   /* zbuf starts mid-member in this file */
+  struct logfile *next_member;    /* next logfile with an open member */
+  struct ld_entry *entries;       /* indexed files, oldest first */
+  struct ld_entry **entries_tail; /* end of entries list */
+  struct ld_entry *uncompressed;  /* first indexed file to compress */
+  int schedule;                   /* LD_EVERY_DAY, LD_MIDNIGHT, etc */
+  int schedule_at;                /* minutes after midnight, for LD_AT */
+  int prefix;                     /* LD_PREFIX_... flags */
+  time_t stamp_sec;               /* second that stamp is for */
+  char stamp[48];                 /* formatted time prefix */
+  size_t stamp_len, stamp_frac;   /* its length, offset of microseconds */
+  int writer;                     /* writer thread to use, or -1 for any */
+  struct ld_batch *batch;         /* its writes, if in a writer thread */
+  struct input *stalled;          /* inputs waiting for it to be written */
+};
+
+/* a program for compressing old log files */
+struct ld_codec {
+  const char *name;   /* program name */
+  const char *suffix; /* suffix it adds */
+  const char *remove; /* option to remove the original, or 0 */
 };
 
 struct syslogfile {
@@ -43,17 +104,68 @@ struct syslogfile {
 };
 
 struct input {
-  struct input *next;       /* next input */
-  int fd;                   /* file descriptor */
-  struct timeval suspended; /* suspended due to errors */
-  void (*input_callback)(struct input *, struct timeval); /* input callback */
-  void (*daily_callback)(struct input *, struct timeval); /* daily callback */
-  void *log; /* logfile to write to */
+  struct input *next;           /* next input */
+  int fd;                       /* file descriptor */
+  struct timeval suspended;     /* suspended due to errors */
+  struct input *next_suspended; /* next suspended input */
+  /* input callback */
+  void (*input_callback)(struct input *, struct timeval);
+  /* daily callback */
+  void (*daily_callback)(struct input *, struct timeval);
+  void *log;                    /* logfile to write to */
+  char *buffer;                 /* data read but not yet written */
+  size_t bytes;                 /* bytes in buffer */
+  struct logfile *pending_on;   /* logfile it's pending on, or 0 */
+  struct input *next_pending;   /* next input pending on that logfile */
+  struct timeval due;           /* when to next call daily_callback */
+  size_t timer;                 /* position in timer heap, or -1 */
+  char *name;                   /* name for line prefixes (owned), or 0 */
+  pid_t pid;                    /* pid for line prefixes, or 0 */
+  char *tag;                    /* formatted name and pid, or 0 */
+  char *prefix;                 /* line prefix for data in buffer */
+  size_t prefix_len;            /* its length, or 0 if not prefixing */
+  int midline;                  /* true if the data so far ends mid-line */
+  int buffer_midline;           /* true if buffer starts mid-line */
+  struct shmring *shm;          /* shared memory ring, or 0 */
+  int hangup_fd;                /* EOF when the ring's producer exits, or
+                                 * -1 (including once it has) */
+  int in_flight;                /* true while a writer thread has its data */
+  struct logfile *stalled_on;   /* logfile it's stalled on, or 0 */
+  struct input *next_stalled;   /* next input stalled on that logfile */
+  int deleted;                  /* to be deleted once its data is written */
 };
 
 /* create a new logfile object.  Initialize the pattern field with a
  * pointer to a copy of PATTERN.  rotate and compress are 0 by
- * default, usegmt is 1 by default.
+ * default, usegmt is 1 by default, backlog_max and overflow are
+ * ld_backlog and ld_overflow by default.  schedule is LD_EVERY_DAY
+ * by default; see ld_parse_schedule().
+ *
+ * If prefix is set, each line written is preceded by the time it was
+ * read (if it includes LD_PREFIX_TIME), then the input's name and pid
+ * (if it includes LD_PREFIX_NAME and LD_PREFIX_PID, and they are
+ * set), for example "2014-01-02T03:04:05.678901Z name[1234]: ".  The
+ * time is in GMT if usegmt is set and local time (with the offset)
+ * otherwise.  Set the inputs' name and pid before they have anything
+ * to read.
+ *
+ * If stream is set (which requires zlib), data is compressed as it is
+ * logged and the file written is the expansion of the pattern plus
+ * ".gz".  Each gzip member is written out once it contains
+ * ld_member_size bytes, is ld_member_interval seconds old, or the file
+ * is closed, so the file is a valid gzip file (and readable with
+ * zcat) up to the last member written.
+ *
+ * If max_size is set, a file is not written to once it's that big;
+ * instead the next segment is started, which is the expansion of the
+ * pattern plus ".1", ".2", etc.  The limit is checked before each
+ * write, so a file can exceed it by one write's worth of data.
+ *
+ * If ld_writers is set, ld_loop writes logfiles from that many writer
+ * threads, so that one on slow storage only holds up its own inputs.
+ * Set writer to choose the thread (modulo ld_writers); the default of
+ * -1 shares them out in turn.  Logfiles with stream set are always
+ * written by ld_loop itself.
  *
  * If a logfile object with the same pattern already exists, that is
  * returned instead.
@@ -81,6 +193,17 @@ void ld_delete_syslogfile(struct syslogfile *l);
  */
 struct input *ld_new_input(int fd, void *l);
 
+/* create a new input object that reads from shared memory ring R
+ * (see shmring.h), which it takes ownership of, and writes to L.  The
+ * ring's producer is finished once HANGUP_FD (the read end of a pipe
+ * it holds the write end of) reaches EOF.
+ *
+ * Data is written to L straight out of the ring, with no copying.
+ * L's prefix is not applied to it.
+ */
+struct input *ld_new_shm_input(struct shmring *r, int hangup_fd,
+                               struct logfile *l);
+
 /* delete an input object */
 void ld_delete_input(struct input *i);
 
@@ -95,7 +218,11 @@ void ld_suspend_input(struct input *i);
 void ld_resume_input(struct input *i);
 
 /* open the output file for logfile L corresponding to time NOW.
- * Returns 0 on success and -1 on error. */
+ * Returns 0 on success and -1 on error.
+ *
+ * The expanded path is remembered along with the period it's right
+ * for (which depends on the conversions in the pattern), so this is
+ * cheap if the right file is already open. */
 
 int ld_open_logfile(struct logfile *l, struct timeval now);
 
@@ -104,34 +231,80 @@ int ld_open_logfile(struct logfile *l, struct timeval now);
 void ld_close_logfile(struct logfile *l);
 
 /* return the next time, after NOW, that rotation, compression, etc,
- * should be started. */
+ * should be started for logfiles with the LD_EVERY_DAY schedule.
+ * This is the next multiple of ld_day seconds, i.e. midnight GMT if
+ * ld_day hasn't been changed. */
 struct timeval ld_next_daily(struct timeval now);
 
-/* wait for and process events.  When there are no more inputs,
- * returns 0 (so set some up before calling!).  If an error occurs
- * that can't be safely dealt with, returns -1.
+/* return the next time, after NOW, that L's daily callbacks should
+ * run */
+struct timeval ld_next_scheduled(const struct logfile *l, struct timeval now);
+
+/* set L's schedule from S, which is one of:
+ *   day        every ld_day seconds (the default)
+ *   midnight   at local midnight
+ *   hourly     on the hour
+ *   HH:MM      at a local time of day
+ * Returns 0 on success and -1 if S isn't understood. */
+int ld_parse_schedule(struct logfile *l, const char *s);
+
+/* wait for and process events.  When there are no more inputs, and
+ * no compressors running, returns 0 (so set some up before
+ * calling!).  If an error occurs that can't be safely dealt with,
+ * returns -1.
  *
  * when a non-suspended input's file descriptor is readable, its input
  * callback is called.  Also, at or shortly after the times returned
- * by ld_next_daily(), the daily callbacks are called (even for
- * suspended inputs). */
+ * by ld_next_scheduled() for its logfile, each input's daily callback
+ * is called (even for suspended inputs).  Inputs whose daily callback
+ * isn't ld_daily_callback are assumed to have a logfile that doesn't
+ * have a schedule, and use ld_next_daily().  Deadlines are kept in a
+ * heap, so each wakeup only costs as much as the number of inputs
+ * that are due.
+ *
+ * Inputs are watched with an event loop (see evloop.h), so there is
+ * no limit on their file descriptor numbers and the cost of a wakeup
+ * doesn't depend on how many there are. */
 int ld_loop(void);
 
 /* the default input callback.
  *
- * First, it opens the output file for the input's logfile at the
- * current time.  If this fails, suspends the input and returns.
- *
- * Next, it tries to flush any buffered data.  If it can't flush all
- * the buffered data, it suspends the input and returns.
+ * It reads from the input until it would block or the input's buffer
+ * (ld_bufsize bytes) is full, and queues what it read on the input's
+ * logfile.  Once every ready input has been read, ld_loop writes each
+ * logfile's queue with a single writev(2) (in its writer thread, if
+ * it has one), so several inputs sharing a logfile cost one write
+ * between them.  If the event loop isn't running, the data is written
+ * straight away.  If the read fails, or EOF is detected, queued data
+ * is written and the input is deleted.  An input that can't be read
+ * any further (its buffer is full, LD_BLOCK allows no more, or its
+ * logfile is still being written by a writer thread) isn't watched
+ * until its logfile has been written.
  *
- * After this it reads some data and tries to write it to the output
- * file.  If the read fails, or EOF is detected, the input is deleted.
- * If some or all of it cannot be written, it is buffered and the
- * input is suspended.
+ * Writing opens the output file for the logfile at the current time.
+ * If this fails, or some of the data can't be written, the data is
+ * saved in the logfile's backlog for next time and the inputs
+ * concerned are suspended.  The backlog holds at most backlog_max
+ * bytes.  What happens when that's not enough depends on overflow:
+ * LD_DROP_OLDEST and LD_DROP_NEWEST discard data (and count it in
+ * dropped); LD_BLOCK limits how much is read from the inputs so
+ * that nothing has to be discarded, which eventually makes the
+ * programs writing to them block.
  */
 void ld_input_callback(struct input *i, struct timeval now);
 
+/* the input callback for shared memory rings.
+ *
+ * Like ld_input_callback, but instead of copying data out of the
+ * ring it just notes how much of it is queued; it is consumed from
+ * the ring once it has been written (or put in the backlog).  With
+ * LD_BLOCK, what's left in the ring makes the producer wait for space
+ * rather than the ring being drained into the backlog.  That holds
+ * after the producer has finished too: the input is only deleted once
+ * the ring is empty.
+ */
+void ld_shm_callback(struct input *i, struct timeval now);
+
 /* the default daily callback.  Everything here happens in terms of
  * the logfile for input I, rather than the input itself.
  *
@@ -157,7 +330,16 @@ void ld_input_callback(struct input *i, struct timeval now);
  *
  * If the compress field is nonzero then it looks for uncompressed
  * regular files that match the pattern and are strictly older than a
- * day.  For these files, gzip is invoked to compress them.
+ * day.  These are queued to be compressed with ld_codec, by at most
+ * ld_compressors processes at once.  The compressors run in the
+ * background; ld_loop notices when they finish, and doesn't return
+ * until they have all finished.
+ *
+ * If ld_index is set then the files are found from the index instead,
+ * oldest first, stopping at the first one that isn't due for deletion
+ * or compression.  No globbing is done and only the candidate files
+ * are examined, so the cost depends on the number of files that
+ * have expired, not the number being kept.
  */
 void ld_daily_callback(struct input *i, struct timeval now);
 
@@ -186,6 +368,48 @@ extern struct input *ld_inputs;
 /* number of seconds between rotations (usually 86400, i.e. one day) */
 extern long ld_day;
 
+/* size of each input's read buffer */
+extern size_t ld_bufsize;
+
+/* default backlog size and overflow policy for new logfiles */
+extern size_t ld_backlog;
+extern int ld_overflow;
+
+/* seconds to stop reading inputs for when their data can't be
+ * written, before trying again */
+extern long ld_retry;
+
+/* known compressors, terminated by a null name */
+extern const struct ld_codec ld_codecs[];
+
+/* compressor to use for old log files (default gzip), the level to
+ * pass it (or 0 for its default), and the most to run at once */
+extern const struct ld_codec *ld_codec;
+extern int ld_level;
+extern int ld_compressors;
+
+/* when logfiles with stream set finish a gzip member */
+extern size_t ld_member_size;
+extern long ld_member_interval;
+
+/* if not 0, the path of an index of the log files that have been
+ * created.  ld_loop reads it, and it is appended to as files are
+ * created, compressed and deleted.  If ld_rescan is set then ld_loop
+ * rebuilds it, by searching for each logfile's files as
+ * ld_daily_callback would without an index. */
+extern const char *ld_index;
+extern int ld_rescan;
+
+/* number of writer threads for ld_loop to write logfiles from, or 0
+ * to write them itself.  ld_loop still reads the inputs and opens the
+ * files; a writer thread just makes the writes, and until they're
+ * done, the inputs whose data they are aren't read any further.
+ * Ignored if threads aren't supported. */
+extern int ld_writers;
+
+/* return the codec called NAME, or 0 if there isn't one */
+const struct ld_codec *ld_find_codec(const char *name);
+
 /* compare timevals */
 int tvcmp(const struct timeval *a, const struct timeval *b);
 
@@ -27,6 +27,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <sys/wait.h>
 
 #include "utils.h"
@@ -41,20 +42,77 @@ static struct option const long_options[] = {
     {"max-log-age", required_argument, 0, 'm'},
     {"log-in-child", no_argument, 0, 'C'},
     {"day", required_argument, 0, 'D'},
+    {"buffer", required_argument, 0, 'b'},
+    {"backlog", required_argument, 0, 'B'},
+    {"overflow", required_argument, 0, 'O'},
+    {"retry", required_argument, 0, 'r'},
+    {"codec", required_argument, 0, 'z'},
+    {"level", required_argument, 0, 'L'},
+    {"jobs", required_argument, 0, 'j'},
+    {"stream", no_argument, 0, 's'},
+    {"flush-size", required_argument, 0, 'F'},
+    {"flush-interval", required_argument, 0, 'T'},
+    {"max-size", required_argument, 0, 'S'},
+    {"index", required_argument, 0, 'I'},
+    {"rescan", no_argument, 0, 'R'},
+    {"schedule", required_argument, 0, 't'},
+    {"prefix", required_argument, 0, 'P'},
+    {"shm-size", required_argument, 0, 'M'},
+    {"writers", required_argument, 0, 'W'},
     {0, 0, 0, 0}};
 
+static const struct lookuptable overflow_policies[] = {
+    {"block", LD_BLOCK},
+    {"drop-oldest", LD_DROP_OLDEST},
+    {"drop-newest", LD_DROP_NEWEST},
+    {0, 0}};
+
+static const struct lookuptable prefix_fields[] = {
+    {"time", LD_PREFIX_TIME},
+    {"name", LD_PREFIX_NAME},
+    {"pid", LD_PREFIX_PID},
+    {0, 0}};
+
 /* write a usage message to FP and exit with the specified status */
 
 static void __attribute__((noreturn)) usage(FILE *fp, int exit_status) {
   if(fputs("Usage:\n"
-           "  logfds [options] [--] fd[,fd...] path ... [--] command ...\n"
+           "  logfds [options] [--] fd[,fd...]|shm path ... [--] command ...\n"
            "\n"
            "Options:\n"
            "  -c, --compress                        Compress logs\n"
+           "  -z CODEC, --codec CODEC               Compress with CODEC\n"
+           "  -L N, --level N                       Compression level\n"
+           "  -j N, --jobs N                        Compressors to run at "
+           "once\n"
+           "  -s, --stream                          Compress logs as they are "
+           "written\n"
+           "  -F BYTES, --flush-size BYTES          Bytes per compressed "
+           "block\n"
+           "  -T SECONDS, --flush-interval SECONDS  Seconds per compressed "
+           "block\n"
            "  -m DAYS, --max-log-age DAYS           Delete old logs\n"
+           "  -S BYTES, --max-size BYTES            Start a new file after "
+           "BYTES\n"
+           "  -I PATH, --index PATH                 Keep an index of log "
+           "files\n"
+           "  -R, --rescan                          Rebuild the index\n"
+           "  -t WHEN, --schedule WHEN              When to delete and "
+           "compress logs\n"
+           "  -P FIELDS, --prefix FIELDS            Prefix lines with "
+           "time,name,pid\n"
+           "  -M BYTES, --shm-size BYTES            Shared memory ring size\n"
+           "  -W N, --writers N                     Write logs from N "
+           "threads\n"
            "  -q                                    Quiet mode\n"
            "  -C                                    Log in the child, not the "
            "parent\n"
+           "  -b BYTES, --buffer BYTES              Read buffer size\n"
+           "  -B BYTES, --backlog BYTES             Unwritten data limit\n"
+           "  -O POLICY, --overflow POLICY          block, drop-oldest or "
+           "drop-newest\n"
+           "  -r SECONDS, --retry SECONDS           Time between write "
+           "attempts\n"
            "  -h, --help                            Usage message\n"
            "  -V, --version                         Version number\n",
            fp)
@@ -67,6 +125,15 @@ int main(int argc, char **argv) {
   int n;
   int max = 0;
   int compress = 0;
+  int stream = 0;
+  off_t max_size = 0;
+  const char *schedule = 0;
+  int prefix = 0, field;
+  size_t shm_size = 1024 * 1024;
+  struct shmring *shm = 0;
+  int hangup = -1, target, above = 3;
+  char **v;
+  struct input *i;
   struct fdmap *fds = 0;
   int quiet = 0;
   int loginchild = 0;
@@ -75,7 +142,9 @@ int main(int argc, char **argv) {
 
   setprogname(argv[0]);
 
-  while((n = getopt_long(argc, argv, "hVqcm:D:C", long_options, (int *)0))
+  while((n = getopt_long(argc, argv,
+                         "hVqcm:D:Cb:B:O:r:z:L:j:sF:T:S:I:Rt:P:M:W:",
+                         long_options, (int *)0))
         >= 0) {
     switch(n) {
     case 'V': printf("logfds %s\n", VERSION); return 0;
@@ -84,6 +153,11 @@ int main(int argc, char **argv) {
 
     case 'm': max = atoi(optarg); break;
 
+    case 'S':
+      if((max_size = atoll(optarg)) <= 0)
+        fatal("--max-size value must be positive");
+      break;
+
     case 'c': compress = 1; break;
 
     case 'q': ++quiet; break;
@@ -92,45 +166,151 @@ int main(int argc, char **argv) {
 
     case 'C': loginchild = 1; break;
 
+    case 'b':
+      if(atol(optarg) <= 0)
+        fatal("--buffer value must be positive");
+      ld_bufsize = atol(optarg);
+      break;
+
+    case 'B':
+      if(atol(optarg) <= 0)
+        fatal("--backlog value must be positive");
+      ld_backlog = atol(optarg);
+      break;
+
+    case 'O':
+      if((ld_overflow = lookup(overflow_policies, optarg)) < 0)
+        fatal("unknown --overflow '%s'", optarg);
+      break;
+
+    case 'r':
+      if((ld_retry = atol(optarg)) <= 0)
+        fatal("--retry value must be positive");
+      break;
+
+    case 'z':
+      if(!(ld_codec = ld_find_codec(optarg)))
+        fatal("unknown --codec '%s'", optarg);
+      break;
+
+    case 'L':
+      if((ld_level = atoi(optarg)) <= 0)
+        fatal("--level value must be positive");
+      break;
+
+    case 'j':
+      if((ld_compressors = atoi(optarg)) <= 0)
+        fatal("--jobs value must be positive");
+      break;
+
+    case 's':
+#if HAVE_ZLIB
+      stream = 1;
+      break;
+#else
+      fatal("--stream is not supported on this platform");
+#endif
+
+    case 'I': ld_index = optarg; break;
+
+    case 'R': ld_rescan = 1; break;
+
+    case 't': schedule = optarg; break;
+
+    case 'P':
+      v = split(optarg, ',');
+      for(n = 0; v[n]; ++n) {
+        if((field = lookup(prefix_fields, v[n])) < 0)
+          fatal("unknown --prefix field '%s'", v[n]);
+        prefix |= field;
+        free(v[n]);
+      }
+      free(v);
+      break;
+
+    case 'M':
+      if(atol(optarg) <= 0)
+        fatal("--shm-size value must be positive");
+      shm_size = atol(optarg);
+      break;
+
+    case 'W':
+      if((ld_writers = atoi(optarg)) <= 0)
+        fatal("--writers value must be positive");
+      break;
+
+    case 'F':
+      if(atol(optarg) <= 0)
+        fatal("--flush-size value must be positive");
+      ld_member_size = atol(optarg);
+      break;
+
+    case 'T':
+      if((ld_member_interval = atol(optarg)) <= 0)
+        fatal("--flush-interval value must be positive");
+      break;
+
     default: usage(stderr, 1);
     }
   }
+  if(stream && strcmp(ld_codec->name, "gzip"))
+    fatal("--stream only supports --codec gzip");
+  if(ld_rescan && !ld_index)
+    fatal("--rescan requires --index");
 
   /* process all redirections */
-  while(optind < argc && isdigit(argv[optind][0])) {
-    char **v;
+  while(optind < argc && (isdigit(argv[optind][0])
+                          || !strcmp(argv[optind], "shm"))) {
     int p[2];
     struct logfile *l;
     int first = 1;
+    const char *name = argv[optind];
+    int is_shm = !strcmp(name, "shm");
 
     /* check that there's a pattern */
     if(optind + 1 >= argc)
       fatal("missing filename pattern in redirection");
-    /* create the pipe */
+    /* create the pipe.  For a ring, it just tells us when the command
+     * has finished. */
     pipe_e(p);
     /* make sure the input end is closed in the child */
     cloexec(p[0]);
-    v = split(argv[optind], ',');
-    if(!*v)
-      fatal("empty file descriptor list in redirection");
-    for(n = 0; v[n]; ++n) {
-      int fd;
-
-      if(!v[n][0] || v[n][strspn(v[n], "0123456789")])
-        fatal("invalid file descriptor in redirection");
-      /* we dup() file descriptors to keep the fdmap_* functions
-       * happy */
-      fd = first ? p[1] : dup_e(p[1]);
-      fdmap_add(&fds, fd, atoi(v[n]));
-      free(v[n]);
-      first = 0;
+    if(is_shm) {
+      if(shm)
+        fatal("only one shm redirection is allowed");
+      shm = shmring_create(shm_size);
+      hangup = p[1];
+    } else {
+      v = split(argv[optind], ',');
+      if(!*v)
+        fatal("empty file descriptor list in redirection");
+      for(n = 0; v[n]; ++n) {
+        int fd;
+
+        if(!v[n][0] || v[n][strspn(v[n], "0123456789")])
+          fatal("invalid file descriptor in redirection");
+        /* we dup() file descriptors to keep the fdmap_* functions
+         * happy */
+        fd = first ? p[1] : dup_e(p[1]);
+        fdmap_add(&fds, fd, target = atoi(v[n]));
+        if(target >= above)
+          above = target + 1;
+        free(v[n]);
+        first = 0;
+      }
+      free(v);
     }
-    free(v);
     ++optind;
     l = ld_new_logfile(argv[optind]);
     l->rotate = max;
     l->compress = compress;
-    ld_new_input(p[0], l);
+    l->stream = stream;
+    l->max_size = max_size;
+    if(schedule && ld_parse_schedule(l, schedule) < 0)
+      fatal("invalid --schedule '%s'", schedule);
+    l->prefix = prefix;
+    i = is_shm ? ld_new_shm_input(shm, p[0], l) : ld_new_input(p[0], l);
+    i->name = xstrdup(name);
     ++optind;
   }
 
@@ -146,6 +326,20 @@ int main(int argc, char **argv) {
   pid = fork_e();
   if(loginchild ? pid != 0 : pid == 0) {
     exiter = _exit;
+    /* move the ring out of the way of the redirections, and let the
+     * command inherit it */
+    if(shm) {
+      struct shmring moved = *shm;
+
+      moved.memfd = fcntl_e(shm->memfd, F_DUPFD, above);
+      moved.data_fd = fcntl_e(shm->data_fd, F_DUPFD, above);
+      moved.space_fd = fcntl_e(shm->space_fd, F_DUPFD, above);
+      moved.alive[0] = fcntl_e(shm->alive[0], F_DUPFD, above);
+      fcntl_e(hangup, F_DUPFD, above);
+      close(hangup);
+      if(setenv(SHMRING_ENV, shmring_describe(&moved), 1) < 0)
+        fatale("error calling setenv");
+    }
     /* redirect file descriptors */
     fdmap_map(fds);
     if(execvp(argv[optind], argv + optind) < 0)
@@ -153,9 +347,15 @@ int main(int argc, char **argv) {
     fatal("execvp succeeded but returned");
   }
 
+  /* lines are prefixed with the command's pid */
+  for(i = ld_inputs; i; i = i->next)
+    i->pid = loginchild ? getppid() : pid;
+
   /* close writer ends of pipes */
   fdmap_close(fds);
   fdmap_free(fds);
+  if(hangup != -1)
+    close(hangup);
 
   /* enter the logger event loop */
   if(ld_loop())
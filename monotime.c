@@ -0,0 +1,48 @@
+/*
+   This file is part of rjkshelltools
+   Copyright (C) 2014 Richard Kettlewell
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <config.h>
+
+#include <time.h>
+#include <sys/time.h>
+
+#include "utils.h"
+
+double monotime(void) {
+#if HAVE_CLOCK_GETTIME && defined CLOCK_MONOTONIC
+  struct timespec ts;
+
+  if(clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+    fatale("error calling clock_gettime");
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#else
+  struct timeval tv;
+
+  if(gettimeofday(&tv, 0) < 0)
+    fatale("error calling gettimeofday");
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+End:
+*/
@@ -0,0 +1,183 @@
+/*
+   This file is part of rjkshelltools
+   Copyright (C) 2014 Richard Kettlewell
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "utils.h"
+#include "ring.h"
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0
+#endif
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0
+#endif
+
+/* return the size of a huge page */
+static size_t huge_page_size(void) {
+  static size_t size;
+  FILE *fp;
+  char line[128];
+  unsigned long kb;
+
+  if(!size) {
+    size = 2 * 1024 * 1024; /* the usual x86 size */
+    if((fp = fopen("/proc/meminfo", "r"))) {
+      while(fgets(line, sizeof line, fp))
+        if(sscanf(line, "Hugepagesize: %lu kB", &kb) == 1 && kb)
+          size = kb * 1024;
+      fclose(fp);
+    }
+  }
+  return size;
+}
+
+/* round SIZE up to a multiple of UNIT */
+static size_t round_up(size_t size, size_t unit) {
+  return (size + unit - 1) / unit * unit;
+}
+
+#if HAVE_MEMFD_CREATE
+/* try to map SIZE bytes twice into R; HUGE says whether to use
+ * hugetlbfs.  On failure R is left alone. */
+static void mirror(struct ring *r, size_t size, int huge) {
+  size_t align = huge ? huge_page_size() : 0, slack;
+  char *base;
+  int fd;
+
+  if((fd = memfd_create("ring", MFD_CLOEXEC | (huge ? MFD_HUGETLB : 0))) < 0)
+    return;
+  if(ftruncate(fd, size) < 0) {
+    close(fd);
+    return;
+  }
+  /* reserve the address space, then map the file into both halves.
+   * Huge pages must be mapped at a multiple of their size, so reserve
+   * extra and trim the reservation to an aligned range. */
+  base = mmap(0, 2 * size + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+              -1, 0);
+  if(base == MAP_FAILED) {
+    close(fd);
+    return;
+  }
+  if(align) {
+    slack = (align - (size_t)base % align) % align;
+    if(slack)
+      munmap(base, slack);
+    if(align - slack)
+      munmap(base + slack + 2 * size, align - slack);
+    base += slack;
+  }
+  if(mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0)
+         == MAP_FAILED
+     || mmap(base + size, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0)
+            == MAP_FAILED) {
+    munmap(base, 2 * size);
+    close(fd);
+    return;
+  }
+  close(fd); /* the mappings keep the memory alive */
+  r->base = base;
+  r->size = size;
+  r->mapped = 2 * size;
+  r->flags |= RING_MIRROR | (huge ? RING_HUGE : 0);
+}
+#endif
+
+void ring_alloc(struct ring *r, size_t size, unsigned flags) {
+  long pagesize = sysconf(_SC_PAGESIZE);
+  size_t n;
+  void *base;
+
+  memset(r, 0, sizeof *r);
+  if(flags & RING_LOCK)
+    flags |= RING_PREFAULT;
+#if HAVE_MEMFD_CREATE
+  if(flags & RING_MIRROR) {
+    if((flags & RING_HUGE) && MFD_HUGETLB)
+      mirror(r, round_up(size, huge_page_size()), 1);
+    if(!r->base)
+      mirror(r, round_up(size, pagesize), 0);
+  }
+#endif
+  if(!r->base && (flags & RING_HUGE) && MAP_HUGETLB) {
+    n = round_up(size, huge_page_size());
+    base = mmap(0, n, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB
+                    | (flags & RING_PREFAULT ? MAP_POPULATE : 0),
+                -1, 0);
+    if(base != MAP_FAILED) {
+      r->base = base;
+      r->size = n;
+      r->mapped = n;
+      r->flags |= RING_HUGE;
+    }
+  }
+  if(!r->base) {
+    n = round_up(size, pagesize);
+    base = mmap(0, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                0);
+    if(base == MAP_FAILED)
+      fatale("error allocating %lu bytes", (unsigned long)n);
+    r->base = base;
+    r->size = size;
+    r->mapped = n;
+  }
+#ifdef MADV_HUGEPAGE
+  /* no hugetlbfs pages, but transparent huge pages might do.  Success
+   * here only means the advice was accepted, so RING_HUGE isn't set. */
+  if((flags & RING_HUGE) && !(r->flags & RING_HUGE))
+    madvise(r->base, r->mapped, MADV_HUGEPAGE);
+#endif
+  if(flags & RING_LOCK) {
+    if(mlock(r->base, r->mapped) < 0)
+      fatale("error locking %lu bytes", (unsigned long)r->mapped);
+    r->flags |= RING_LOCK;
+  }
+  if(flags & RING_PREFAULT) {
+    /* both halves of a mirrored ring need their page tables filling
+     * in, so touch every page of the mapping */
+    for(n = 0; n < r->mapped; n += pagesize)
+      ((volatile char *)r->base)[n] = 0;
+    r->flags |= RING_PREFAULT;
+  }
+}
+
+void ring_free(struct ring *r) {
+  if(r->base && munmap(r->base, r->mapped) < 0)
+    fatale("error calling munmap");
+  memset(r, 0, sizeof *r);
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+End:
+*/
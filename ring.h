@@ -0,0 +1,65 @@
+/*
+   This file is part of rjkshelltools
+   Copyright (C) 2014 Richard Kettlewell
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+
+/* Memory for ring buffers.
+ *
+ * A mirrored ring maps the same pages twice, back to back, so that
+ * BASE[N + SIZE] is the same byte as BASE[N].  Data that wraps round
+ * the end of the ring can then be treated as a single contiguous
+ * block.
+ *
+ * All these functions call fatal/fatale on error.  Properties that
+ * can't be had are quietly done without, except for locking; check
+ * the flags member to see what was achieved.  If RING_HUGE can't be
+ * had, transparent huge pages are requested instead, but since there
+ * is no telling whether the kernel provides them the flag stays
+ * clear. */
+
+#define RING_HUGE 1     /* use hugetlbfs pages if possible */
+#define RING_PREFAULT 2 /* fault in every page up front */
+#define RING_LOCK 4     /* lock into memory (implies RING_PREFAULT) */
+#define RING_MIRROR 8   /* map twice, back to back */
+
+struct ring {
+  char *base;     /* start of memory */
+  size_t size;    /* usable size */
+  size_t mapped;  /* bytes of address space used */
+  unsigned flags; /* properties actually achieved */
+};
+
+/* allocate at least SIZE bytes of memory for a ring with properties
+ * FLAGS.  R->size may be rounded up to a page boundary. */
+void ring_alloc(struct ring *r, size_t size, unsigned flags);
+
+/* release the memory used by R */
+void ring_free(struct ring *r);
+
+#endif /* RING_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+End:
+*/
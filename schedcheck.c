@@ -0,0 +1,82 @@
+/*
+   This file is part of rjkshelltools
+   Copyright (C) 2014 Richard Kettlewell
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* Print the first COUNT daily callbacks, after START (seconds since
+ * the epoch), for one input per SCHEDULE, in the order ld_loop would
+ * run them.  Each schedule's deadlines come from ld_next_scheduled,
+ * so TZ decides what they are.  Each logfile's pattern is just its
+ * schedule, since no files are opened.  Used by the tests. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "utils.h"
+#include "logdaemon.h"
+
+int main(int argc, char **argv) {
+  struct logfile **logs;
+  struct timeval now, *due;
+  struct tm t;
+  char when[64];
+  long count;
+  int n, nlogs, first;
+
+  setprogname("schedcheck");
+  if(argc < 4)
+    fatal("usage: schedcheck START COUNT SCHEDULE ...");
+  now.tv_sec = atol(argv[1]);
+  now.tv_usec = 0;
+  count = atol(argv[2]);
+  nlogs = argc - 3;
+  logs = xmalloc(nlogs * sizeof *logs);
+  due = xmalloc(nlogs * sizeof *due);
+  for(n = 0; n < nlogs; ++n) {
+    logs[n] = ld_new_logfile(argv[n + 3]);
+    if(ld_parse_schedule(logs[n], argv[n + 3]) < 0)
+      fatal("invalid schedule '%s'", argv[n + 3]);
+    due[n] = ld_next_scheduled(logs[n], now);
+  }
+  while(count-- > 0) {
+    /* the earliest deadline goes first; ties go to the first input */
+    first = 0;
+    for(n = 1; n < nlogs; ++n)
+      if(tvcmp(&due[n], &due[first]) < 0)
+        first = n;
+    now = due[first];
+    localtime_r(&now.tv_sec, &t);
+    strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S %Z", &t);
+    if(printf("%s %s\n", when, argv[first + 3]) < 0)
+      fatale("error writing to stdout");
+    due[first] = ld_next_scheduled(logs[first], now);
+  }
+  if(fflush(stdout) < 0)
+    fatale("error writing to stdout");
+  return 0;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+End:
+*/
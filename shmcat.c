@@ -0,0 +1,58 @@
+/*
+   This file is part of rjkshelltools
+   Copyright (C) 2014 Richard Kettlewell
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* Copy standard input to the shared memory ring described by
+ * SHMRING_ENV, a line at a time, as a program logging through
+ * "logfds shm" would.  Used by the tests. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "shmring.h"
+
+int main(int argc, char __attribute__((unused)) * *argv) {
+  struct shmring *r;
+  char *line;
+
+  setprogname("shmcat");
+  if(argc != 1)
+    fatal("usage: shmcat < INPUT");
+  if(!(r = shmring_attach(getenv(SHMRING_ENV))))
+    fatale("cannot attach to %s", SHMRING_ENV);
+  while((line = get_line(stdin))) {
+    if(shmring_write(r, line, strlen(line)) < 0)
+      fatale("error writing to ring");
+    free(line);
+  }
+  if(ferror(stdin))
+    fatale("error reading standard input");
+  shmring_free(r);
+  return 0;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+End:
+*/
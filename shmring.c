@@ -0,0 +1,331 @@
+/*
+   This file is part of rjkshelltools
+   Copyright (C) 2014 Richard Kettlewell
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include "utils.h"
+#include "shmring.h"
+
+#define SHMRING_MAGIC 0x52474e52 /* identifies a ring */
+#define SHMRING_HEADER 4096      /* bytes before the data */
+
+/* head and tail only ever increase; the data for position P is at
+ * P % size.  head and tail are on separate cache lines since they're
+ * written by different processes. */
+struct shmring_header {
+  uint32_t magic;          /* SHMRING_MAGIC */
+  uint32_t unused;
+  uint64_t size;           /* size of data */
+  uint64_t head __attribute__((aligned(64))); /* bytes written */
+  uint32_t reader_waiting; /* true if the consumer wants a signal */
+  uint64_t tail __attribute__((aligned(64))); /* bytes read */
+  uint32_t writer_waiting; /* true if the producer wants a signal */
+};
+
+#if HAVE_MEMFD_CREATE && HAVE_SYS_EVENTFD_H
+struct shmring *shmring_create(size_t size) {
+  struct shmring *r = xmalloc(sizeof *r);
+  size_t n = 4096;
+
+  while(n < size)
+    n *= 2;
+  r->size = n;
+  if((r->memfd = memfd_create("shmring", MFD_CLOEXEC)) < 0)
+    fatale("error calling memfd_create");
+  if(ftruncate(r->memfd, SHMRING_HEADER + r->size) < 0)
+    fatale("error calling ftruncate");
+  if((r->h = mmap(0, SHMRING_HEADER + r->size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, r->memfd, 0))
+     == MAP_FAILED)
+    fatale("error calling mmap");
+  r->data = (char *)r->h + SHMRING_HEADER;
+  /* both sides only read the eventfds once they're known to be
+   * readable, so they can be non-blocking for both */
+  if((r->data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+     || (r->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    fatale("error calling eventfd");
+  pipe_e(r->alive);
+  cloexec(r->alive[0]);
+  cloexec(r->alive[1]);
+  r->head = r->tail = 0;
+  r->h->magic = SHMRING_MAGIC;
+  r->h->size = r->size;
+  /* the consumer won't look until it's told there's something there */
+  r->h->reader_waiting = 1;
+  return r;
+}
+
+char *shmring_describe(const struct shmring *r) {
+  char buffer[64];
+
+  snprintf(buffer, sizeof buffer, "%d,%d,%d,%d", r->memfd, r->data_fd,
+           r->space_fd, r->alive[0]);
+  return xstrdup(buffer);
+}
+
+/* update R's copy of head from the shared header, unless the producer
+ * has written something impossible there */
+static void update_head(struct shmring *r, int order) {
+  uint64_t head = __atomic_load_n(&r->h->head, order);
+
+  if(head - r->tail <= r->size && head - r->tail >= r->head - r->tail)
+    r->head = head;
+}
+
+size_t shmring_available(struct shmring *r) {
+  update_head(r, __ATOMIC_ACQUIRE);
+  return r->head - r->tail;
+}
+
+int shmring_iov(const struct shmring *r, size_t n, struct iovec iov[2]) {
+  size_t offset = r->tail & (r->size - 1);
+
+  if(!n)
+    return 0;
+  if(n > r->head - r->tail)
+    n = r->head - r->tail;
+  iov[0].iov_base = r->data + offset;
+  if(offset + n <= r->size) {
+    iov[0].iov_len = n;
+    return 1;
+  }
+  iov[0].iov_len = r->size - offset;
+  iov[1].iov_base = r->data;
+  iov[1].iov_len = n - iov[0].iov_len;
+  return 2;
+}
+
+/* make eventfd FD readable */
+static int notify(int fd) {
+  uint64_t one = 1;
+
+  if(write(fd, &one, sizeof one) < 0 && errno != EAGAIN)
+    return -1;
+  return 0;
+}
+
+void shmring_consume(struct shmring *r, size_t n) {
+  if(!n)
+    return;
+  r->tail += n;
+  __atomic_store_n(&r->h->tail, r->tail, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&r->h->writer_waiting, __ATOMIC_SEQ_CST)
+     && __atomic_exchange_n(&r->h->writer_waiting, 0, __ATOMIC_SEQ_CST)
+     && notify(r->space_fd) < 0)
+    fatale("error writing to eventfd");
+}
+
+int shmring_idle(struct shmring *r, size_t taken) {
+  __atomic_store_n(&r->h->reader_waiting, 1, __ATOMIC_SEQ_CST);
+  /* the producer might have written something just before it could
+   * have seen the flag */
+  update_head(r, __ATOMIC_SEQ_CST);
+  if(r->head - r->tail > taken) {
+    __atomic_store_n(&r->h->reader_waiting, 0, __ATOMIC_SEQ_CST);
+    return 0;
+  }
+  return 1;
+}
+
+void shmring_signal(struct shmring *r, int wake) {
+  uint64_t count;
+
+  if(wake) {
+    if(notify(r->data_fd) < 0)
+      fatale("error writing to eventfd");
+  } else if(read(r->data_fd, &count, sizeof count) < 0 && errno != EAGAIN)
+    fatale("error reading from eventfd");
+}
+
+struct shmring *shmring_attach(const char *spec) {
+  struct shmring *r;
+  struct stat sb;
+  char junk;
+
+  if(!spec) {
+    errno = ENOENT;
+    return 0;
+  }
+  if(!(r = malloc(sizeof *r)))
+    return 0;
+  r->alive[1] = -1;
+  if(sscanf(spec, "%d,%d,%d,%d%c", &r->memfd, &r->data_fd, &r->space_fd,
+            &r->alive[0], &junk)
+     != 4) {
+    free(r);
+    errno = EINVAL;
+    return 0;
+  }
+  if(fstat(r->memfd, &sb) < 0 || sb.st_size <= SHMRING_HEADER
+     || (r->h = mmap(0, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     r->memfd, 0))
+            == MAP_FAILED) {
+    free(r);
+    return 0;
+  }
+  r->size = sb.st_size - SHMRING_HEADER;
+  r->data = (char *)r->h + SHMRING_HEADER;
+  if(r->h->magic != SHMRING_MAGIC || r->h->size != r->size) {
+    munmap(r->h, sb.st_size);
+    free(r);
+    errno = EINVAL;
+    return 0;
+  }
+  return r;
+}
+
+/* wait until the consumer has read past TAIL.  Returns 0 on success,
+ * or -1 with errno set to EPIPE if the consumer has gone away. */
+static int wait_for_space(struct shmring *r, uint64_t tail) {
+  struct pollfd pfd[2];
+  uint64_t count;
+
+  __atomic_store_n(&r->h->writer_waiting, 1, __ATOMIC_SEQ_CST);
+  /* the consumer might have read something just before it could have
+   * seen the flag */
+  if(__atomic_load_n(&r->h->tail, __ATOMIC_SEQ_CST) != tail) {
+    __atomic_store_n(&r->h->writer_waiting, 0, __ATOMIC_SEQ_CST);
+    return 0;
+  }
+  pfd[0].fd = r->space_fd;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = r->alive[0];
+  pfd[1].events = POLLIN;
+  if(poll(pfd, 2, -1) < 0) {
+    if(errno == EINTR)
+      return 0;
+    return -1;
+  }
+  /* nothing is ever written to alive, so readable means EOF */
+  if(pfd[1].revents) {
+    errno = EPIPE;
+    return -1;
+  }
+  if(read(r->space_fd, &count, sizeof count) < 0 && errno != EAGAIN)
+    return -1;
+  return 0;
+}
+
+int shmring_write(struct shmring *r, const void *buffer, size_t n) {
+  const char *p = buffer;
+  uint64_t head = r->h->head, tail;
+  size_t space, chunk, offset, first;
+
+  while(n > 0) {
+    tail = __atomic_load_n(&r->h->tail, __ATOMIC_ACQUIRE);
+    if(!(space = r->size - (head - tail))) {
+      if(wait_for_space(r, tail) < 0)
+        return -1;
+      continue;
+    }
+    chunk = n < space ? n : space;
+    offset = head & (r->size - 1);
+    first = chunk < r->size - offset ? chunk : r->size - offset;
+    memcpy(r->data + offset, p, first);
+    memcpy(r->data, p + first, chunk - first);
+    head += chunk;
+    __atomic_store_n(&r->h->head, head, __ATOMIC_SEQ_CST);
+    p += chunk;
+    n -= chunk;
+    /* only make a system call if the consumer is asleep */
+    if(__atomic_load_n(&r->h->reader_waiting, __ATOMIC_SEQ_CST)
+       && __atomic_exchange_n(&r->h->reader_waiting, 0, __ATOMIC_SEQ_CST)
+       && notify(r->data_fd) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+void shmring_free(struct shmring *r) {
+  munmap(r->h, SHMRING_HEADER + r->size);
+  close(r->memfd);
+  close(r->data_fd);
+  close(r->space_fd);
+  close(r->alive[0]);
+  if(r->alive[1] != -1)
+    close(r->alive[1]);
+  free(r);
+}
+#else
+struct shmring *shmring_create(size_t __attribute__((unused)) size) {
+  fatal("shared memory rings are not supported on this platform");
+}
+
+char *shmring_describe(const struct shmring __attribute__((unused)) * r) {
+  return 0;
+}
+
+size_t shmring_available(struct shmring __attribute__((unused)) * r) {
+  return 0;
+}
+
+int shmring_iov(const struct shmring __attribute__((unused)) * r,
+                size_t __attribute__((unused)) n,
+                struct iovec __attribute__((unused)) iov[2]) {
+  return 0;
+}
+
+void shmring_consume(struct shmring __attribute__((unused)) * r,
+                     size_t __attribute__((unused)) n) {
+}
+
+int shmring_idle(struct shmring __attribute__((unused)) * r,
+                 size_t __attribute__((unused)) taken) {
+  return 1;
+}
+
+void shmring_signal(struct shmring __attribute__((unused)) * r,
+                    int __attribute__((unused)) wake) {
+}
+
+struct shmring *shmring_attach(const char __attribute__((unused)) * spec) {
+  errno = ENOSYS;
+  return 0;
+}
+
+int shmring_write(struct shmring __attribute__((unused)) * r,
+                  const void __attribute__((unused)) * buffer,
+                  size_t __attribute__((unused)) n) {
+  errno = ENOSYS;
+  return -1;
+}
+
+void shmring_free(struct shmring __attribute__((unused)) * r) {
+}
+#endif
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+End:
+*/
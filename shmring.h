@@ -0,0 +1,114 @@
+/*
+   This file is part of rjkshelltools
+   Copyright (C) 2014 Richard Kettlewell
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* Shared memory rings carry data from one producer process to one
+ * consumer process without a system call per write.
+ *
+ * The ring lives in a memfd shared by both processes.  Each side
+ * only signals the other (through an eventfd) when the other has
+ * said it is about to sleep: the consumer when the ring is empty, the
+ * producer when it is full.  So a busy producer only makes system
+ * calls when it gets ahead of the consumer.
+ *
+ * The consumer (e.g. logdaemon) creates the ring and passes its
+ * description to the producer, usually in the environment variable
+ * SHMRING_ENV.  The producer attaches to it with shmring_attach() and
+ * writes to it with shmring_write().
+ *
+ * The consumer doesn't trust anything the producer writes to the
+ * shared header: it keeps its own copy of the tail, and ignores a head
+ * that goes backwards or gets more than a ring's worth ahead.
+ *
+ * Only Linux is supported, since memfd_create(2) and eventfd(2) are
+ * required. */
+
+#define SHMRING_ENV "LOGDAEMON_SHM"
+
+struct shmring {
+  struct shmring_header *h; /* shared header */
+  char *data;               /* shared data */
+  size_t size;              /* size of data, a power of 2 */
+  int memfd;                /* shared memory */
+  int data_fd;              /* eventfd signalled when there's data */
+  int space_fd;             /* eventfd signalled when there's space */
+  int alive[2];             /* pipe that reaches EOF when the consumer
+                             * goes away; the producer only has [0] */
+  uint64_t head;            /* consumer's copy of head */
+  uint64_t tail;            /* consumer's copy of tail */
+};
+
+/* consumer side.  These call fatal/fatale on error. */
+
+/* create a ring holding at least SIZE bytes.  The file descriptors are
+ * close-on-exec, so the producer must clear that before exec, except
+ * for alive[1] which only the consumer should hold. */
+struct shmring *shmring_create(size_t size);
+
+/* return the description of R to pass to the producer, allocated with
+ * xmalloc */
+char *shmring_describe(const struct shmring *r);
+
+/* return the number of bytes that can be read from R */
+size_t shmring_available(struct shmring *r);
+
+/* fill in up to 2 elements of IOV with the first N bytes available
+ * from R, and return the number of elements used */
+int shmring_iov(const struct shmring *r, size_t n, struct iovec iov[2]);
+
+/* discard the first N bytes available from R, waking the producer if
+ * it's waiting for space */
+void shmring_consume(struct shmring *r, size_t n);
+
+/* announce that the consumer is about to wait for data_fd to become
+ * readable, having taken the first TAKEN bytes.  Returns 1 if it
+ * should go ahead, or 0 if there's more to read after all. */
+int shmring_idle(struct shmring *r, size_t taken);
+
+/* clear R's data_fd, or (if WAKE is set) make it readable */
+void shmring_signal(struct shmring *r, int wake);
+
+/* producer side.  These return -1 and set errno on error. */
+
+/* attach to the ring described by SPEC.  Returns 0 if it can't. */
+struct shmring *shmring_attach(const char *spec);
+
+/* write N bytes from BUFFER to R, waiting for space if necessary.
+ * Returns 0 on success.  If the consumer has gone away while waiting,
+ * fails with EPIPE. */
+int shmring_write(struct shmring *r, const void *buffer, size_t n);
+
+/* unmap R and close its file descriptors, whichever side it belongs
+ * to */
+void shmring_free(struct shmring *r);
+
+#endif /* SHMRING_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+End:
+*/
@@ -0,0 +1,68 @@
+/*
+   This file is part of rjkshelltools
+   Copyright (C) 2014 Richard Kettlewell
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+
+#include "utils.h"
+#include "spsc.h"
+
+void spsc_init(struct spsc *q, size_t size) {
+  q->size = 1;
+  while(q->size < size)
+    q->size *= 2;
+  q->slots = xmalloc(q->size * sizeof *q->slots);
+  q->head = q->tail = 0;
+}
+
+void spsc_free(struct spsc *q) {
+  free(q->slots);
+  q->slots = 0;
+}
+
+int spsc_push(struct spsc *q, void *p) {
+  size_t head = q->head;
+
+  if(head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == q->size)
+    return -1;
+  q->slots[head & (q->size - 1)] = p;
+  /* the slot must be filled in before the consumer can see it */
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void *spsc_pop(struct spsc *q) {
+  size_t tail = q->tail;
+  void *p;
+
+  if(tail == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+    return 0;
+  p = q->slots[tail & (q->size - 1)];
+  /* the slot must be read before the producer can reuse it */
+  __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+  return p;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+End:
+*/
@@ -0,0 +1,61 @@
+/*
+   This file is part of rjkshelltools
+   Copyright (C) 2014 Richard Kettlewell
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stddef.h>
+
+/* Bounded queues of pointers between exactly two threads, one pushing
+ * and one popping.  Neither side takes a lock or makes a system call;
+ * waking the other side up, if it might be asleep, is up to the
+ * caller.
+ *
+ * head and tail only ever increase and each is written by just one
+ * side, so they are kept on separate cache lines. */
+
+struct spsc {
+  void **slots;                               /* size slots */
+  size_t size;                                /* a power of 2 */
+  size_t head __attribute__((aligned(64)));   /* pushes so far */
+  size_t tail __attribute__((aligned(64)));   /* pops so far */
+};
+
+/* set up Q to hold at least SIZE pointers.  Calls fatal on error. */
+void spsc_init(struct spsc *q, size_t size);
+
+/* release the memory used by Q */
+void spsc_free(struct spsc *q);
+
+/* add P to the end of Q.  Returns 0 on success or -1 if Q is full.
+ * Only the producer thread may call this. */
+int spsc_push(struct spsc *q, void *p);
+
+/* remove and return the pointer at the front of Q, or 0 if it is
+ * empty.  Only the consumer thread may call this. */
+void *spsc_pop(struct spsc *q);
+
+#endif /* SPSC_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+End:
+*/
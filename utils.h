@@ -260,6 +260,11 @@ pid_t waitpid_e(pid_t pid, int *statusp, int options);
 /* Call setsid(), call fatale() on error */
 void setsid_e(void);
 
+/* return the time in seconds, according to a clock that is not
+ * affected by changes to the system time.  Only differences between
+ * values are meaningful. */
+double monotime(void);
+
 #endif /* UTILS_H */
 
 /*